@@ -42,6 +42,7 @@
 #include "msp430.h"
 #include "in430.h"
 #include "HAL_Dogs102x6.h"
+#include "HAL_SDCard.h"
 
 // Macros
 #ifndef abs
@@ -386,6 +387,9 @@ void Dogs102x6_writeCommand(uint8_t *sCmd, uint8_t i)
     // Make this operation atomic
     __disable_interrupt();
 
+    // Let any SD card DMA frame on USCI_B1 finish first
+    SDCard_wait();
+
     // CS Low
     P7OUT &= ~CS;
 
@@ -453,6 +457,8 @@ void Dogs102x6_writeData(uint8_t *sData, uint8_t i)
     } 
     else 
     {
+      // Let any SD card DMA frame on USCI_B1 finish first
+      SDCard_wait();
     
       // CS Low
       P7OUT &= ~CS;
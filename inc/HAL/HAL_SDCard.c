@@ -58,6 +58,39 @@
 #define SD_CS_OUT       P3OUT
 #define SD_CS_DIR       P3DIR
 
+// DMA channels used for frame transfers. Channel 0 belongs to the ADC.
+// Channel 1 feeds UCB1TXBUF, channel 2 drains UCB1RXBUF.
+//
+// The channels have fixed priorities, channel 0 highest, and the ADC's
+// repeated block transfer holds off channels 1 and 2 until the whole block
+// has been moved. If that takes longer than a byte on the bus then a byte is
+// received before channel 2 has taken the last one and the USCI overruns
+// (UCOE). Channel 2 then never sees the trigger for the lost byte and never
+// finishes, so SDCard_wait() checks for this and aborts the frame.
+#define SD_DMA_TX_TSEL  DMA1TSEL_23                        // UCB1TXIFG
+#define SD_DMA_RX_TSEL  DMA2TSEL_22                        // UCB1RXIFG
+
+// Frames shorter than this are cheaper to clock out by hand than to
+// program the DMA controller for (tokens, CRCs, command responses)
+#define SD_DMA_MIN      16
+
+// Source of the 0xff bytes clocked out while receiving
+static const uint8_t dummy = 0xff;
+
+// The longest that SDCard_wait() polls for a DMA frame to finish before it
+// gives up on it. A 512 byte frame at the initial 397kHz clock takes 10ms,
+// and each poll takes well over 10 MCLK cycles, so this allows over 40ms.
+#define SD_WAIT_MAX     100000UL
+
+// Set while channels 1 and 2 are lent out between frames (SDCard_lendDMA())
+static volatile uint8_t dmaLent;
+
+// Set while a receive frame is running on DMA, so that an overrun is an error
+static uint8_t dmaRx;
+
+static uint16_t SDCard_claimDMA(void);
+static void SDCard_startTx(const uint8_t *pBuffer, uint16_t size, uint16_t incr);
+
 /***************************************************************************//**
  * @brief   Initialize SD Card
  * @param   None
@@ -86,6 +119,16 @@ void SDCard_init(void)
     UCB1BR1 = 0;                                           // f_UCxCLK = 25MHz/63 = 397kHz
     UCB1CTL1 &= ~UCSWRST;                                  // Release USCI state machine
     UCB1IFG &= ~UCRXIFG;
+
+    // DMA channel setup for frame transfers. The trigger selects are OR'd
+    // in so as not to disturb the ADC on channel 0.
+    DMA1CTL = 0;
+    DMA2CTL = 0;
+    DMACTL0 |= SD_DMA_TX_TSEL;
+    DMACTL1 |= SD_DMA_RX_TSEL;
+    DMACTL4 |= DMARMWDIS;                                  // Don't split CPU read-modify-writes
+    DMA1DA = (uintptr_t)&UCB1TXBUF;
+    DMA2SA = (uintptr_t)&UCB1RXBUF;
 }
 
 /***************************************************************************//**
@@ -108,40 +151,45 @@ void SDCard_fastMode(void)
  * @brief   Read a frame of bytes via SPI
  * @param   pBuffer Place to store the received bytes
  * @param   size Indicator of how many bytes to receive
- * @return  None
+ * @return  0 for success, 1 if the frame was aborted (see SDCard_wait())
  ******************************************************************************/
 
-void SDCard_readFrame(uint8_t *pBuffer, uint16_t size)
+uint8_t SDCard_readFrame(uint8_t *pBuffer, uint16_t size)
 {
-    uint16_t gie = __read_status_register() & GIE;              // Store current GIE state
-
-    __disable_interrupt();                                 // Make this operation atomic
+    if (size >= SD_DMA_MIN){
+        SDCard_readFrameDMA(pBuffer, size);
+        return SDCard_wait();
+    }
 
+    SDCard_wait();                                         // Let any DMA frame finish first
     UCB1IFG &= ~UCRXIFG;                                   // Ensure RXIFG is clear
 
-    // Clock the actual data transfer and receive the bytes
+    // Clock the actual data transfer and receive the bytes. Only one byte is
+    // ever in flight so an interrupt here just stretches the clock.
     while (size--){
         while (!(UCB1IFG & UCTXIFG)) ;                     // Wait while not ready for TX
         UCB1TXBUF = 0xff;                                  // Write dummy byte
         while (!(UCB1IFG & UCRXIFG)) ;                     // Wait for RX buffer (full)
         *pBuffer++ = UCB1RXBUF;
     }
-
-    __bis_SR_register(gie);                                // Restore original GIE state
+    return 0;
 }
 
 /***************************************************************************//**
  * @brief   Send a frame of bytes via SPI
  * @param   pBuffer Place that holds the bytes to send
  * @param   size Indicator of how many bytes to send
- * @return  None
+ * @return  0 for success, 1 if the frame was aborted (see SDCard_wait())
  ******************************************************************************/
 
-void SDCard_sendFrame(uint8_t *pBuffer, uint16_t size)
+uint8_t SDCard_sendFrame(uint8_t *pBuffer, uint16_t size)
 {
-    uint16_t gie = __read_status_register() & GIE;              // Store current GIE state
+    if (size >= SD_DMA_MIN){
+        SDCard_sendFrameDMA(pBuffer, size);
+        return SDCard_wait();
+    }
 
-    __disable_interrupt();                                 // Make this operation atomic
+    SDCard_wait();                                         // Let any DMA frame finish first
 
     // Clock the actual data transfer and send the bytes. Note that we
     // intentionally not read out the receive buffer during frame transmission
@@ -155,8 +203,190 @@ void SDCard_sendFrame(uint8_t *pBuffer, uint16_t size)
 
     UCB1RXBUF;                                             // Dummy read to empty RX buffer
                                                            // and clear any overrun conditions
+    return 0;
+}
+
+/***************************************************************************//**
+ * @brief   Start receiving a frame of bytes via SPI using DMA. The function
+ *          returns as soon as the transfer has been started; the buffer
+ *          must not be touched until SDCard_busy() returns 0. The
+ *          interrupt enable is left as it was on entry.
+ * @param   pBuffer Place to store the received bytes
+ * @param   size Indicator of how many bytes to receive
+ * @return  None
+ ******************************************************************************/
+
+void SDCard_readFrameDMA(uint8_t *pBuffer, uint16_t size)
+{
+    uint16_t gie;
+
+    SDCard_wait();
+    gie = SDCard_claimDMA();
+
+    UCB1RXBUF;                                             // Discard any stale byte so that
+    UCB1IFG &= ~UCRXIFG;                                   // RXIFG only fires for this frame
+
+    // Channel 2 moves each received byte into the buffer
+    dmaRx = 1;
+    DMA2DA = (uintptr_t)pBuffer;
+    DMA2SZ = size;
+    DMA2CTL = DMADT_0 + DMADSTINCR_3 + DMASRCBYTE + DMADSTBYTE + DMAEN;
+
+    // Channel 1 clocks out the same dummy byte for every byte received
+    SDCard_startTx(&dummy, size, DMASRCINCR_0);
+    __bis_SR_register(gie);
+}
+
+/***************************************************************************//**
+ * @brief   Start sending a frame of bytes via SPI using DMA. The function
+ *          returns as soon as the transfer has been started; the buffer
+ *          must not be touched until SDCard_busy() returns 0. The
+ *          interrupt enable is left as it was on entry.
+ * @param   pBuffer Place that holds the bytes to send
+ * @param   size Indicator of how many bytes to send
+ * @return  None
+ ******************************************************************************/
+
+void SDCard_sendFrameDMA(uint8_t *pBuffer, uint16_t size)
+{
+    uint16_t gie;
+
+    SDCard_wait();
+    gie = SDCard_claimDMA();
+
+    // As with SDCard_sendFrame() the receive side is left to overrun and
+    // cleaned up once the frame has gone out
+    SDCard_startTx(pBuffer, size, DMASRCINCR_3);
+    __bis_SR_register(gie);
+}
+
+/***************************************************************************//**
+ * @brief   Check whether a DMA frame transfer is still in progress. Both
+ *          channels run in single transfer mode, which clears DMAEN when the
+ *          last byte has been moved, after which the USCI may still be
+ *          shifting out the final byte.
+ * @param   None
+ * @return  1 if the SPI bus is still busy with a frame, 0 otherwise
+ ******************************************************************************/
+
+uint8_t SDCard_busy(void)
+{
+    if ((DMA1CTL | DMA2CTL) & DMAEN)
+        return 1;
+    return (UCB1STAT & UCBUSY) ? 1 : 0;
+}
+
+/***************************************************************************//**
+ * @brief   Wait for any DMA frame transfer to complete. This must be called
+ *          before anything else (such as the LCD driver) uses USCI_B1.
+ *          A receive frame that overruns, or any frame that hasn't finished
+ *          within SD_WAIT_MAX polls, is aborted: both channels are stopped
+ *          and the bus is left idle, and the caller should retry the frame.
+ * @param   None
+ * @return  0 for success, 1 if the frame was aborted
+ ******************************************************************************/
+
+uint8_t SDCard_wait(void)
+{
+    uint32_t n = SD_WAIT_MAX;
+    uint8_t err = 0;
+
+    while (SDCard_busy()){
+        if ((dmaRx && (UCB1STAT & UCOE)) || !--n){
+            DMA1CTL &= ~DMAEN;
+            DMA2CTL &= ~DMAEN;
+            while (UCB1STAT & UCBUSY) ;                    // Let the last byte go out
+            err = 1;
+        }
+    }
+    dmaRx = 0;
+
+    UCB1RXBUF;                                             // Dummy read to empty RX buffer
+                                                           // and clear any overrun conditions
+    return err;
+}
+
+/***************************************************************************//**
+ * @brief   Lend DMA channels 1 and 2 to another SPI user (the accelerometer)
+ *          for a transfer between SD frames. This is called from an ISR.
+ *          The borrower may change the channels and their trigger selects
+ *          freely, and must call SDCard_returnDMA() once both have finished.
+ *          Frames that are started meanwhile wait for them to come back.
+ * @param   None
+ * @return  1 if the channels have been lent, 0 if a frame is using them
+ ******************************************************************************/
+
+uint8_t SDCard_lendDMA(void)
+{
+    if (dmaLent || ((DMA1CTL | DMA2CTL) & DMAEN))
+        return 0;
+    dmaLent = 1;
+    return 1;
+}
+
+/***************************************************************************//**
+ * @brief   Take DMA channels 1 and 2 back after SDCard_lendDMA(), putting
+ *          back the trigger selects and fixed addresses that SDCard_init()
+ *          set up.
+ * @param   None
+ * @return  None
+ ******************************************************************************/
+
+void SDCard_returnDMA(void)
+{
+    DMA1CTL = 0;
+    DMA2CTL = 0;
+    DMACTL0 = (DMACTL0 & ~DMA1TSEL_31) | SD_DMA_TX_TSEL;
+    DMACTL1 = (DMACTL1 & ~DMA2TSEL_31) | SD_DMA_RX_TSEL;
+    DMA1DA = (uintptr_t)&UCB1TXBUF;
+    DMA2SA = (uintptr_t)&UCB1RXBUF;
+    dmaLent = 0;
+}
+
+/***************************************************************************//**
+ * @brief   Wait for DMA channels 1 and 2 to be returned if they have been
+ *          lent out, and leave interrupts disabled so that they can't be lent
+ *          out again before the frame is armed. The caller restores the
+ *          returned interrupt enable once it has armed the channels.
+ * @param   None
+ * @return  The GIE bit of the status register on entry
+ ******************************************************************************/
+
+static uint16_t SDCard_claimDMA(void)
+{
+    uint16_t gie = __read_status_register() & GIE;
+
+    __disable_interrupt();
+    while (dmaLent)
+    {
+        // Let the borrower's completion interrupt in, which can't happen
+        // until after the instruction that follows EINT
+        __enable_interrupt();
+        __no_operation();
+        __disable_interrupt();
+    }
+
+    return gie;
+}
+
+/***************************************************************************//**
+ * @brief   Arm DMA channel 1 to feed the transmit buffer and kick it off
+ * @param   pBuffer Source of the bytes to send
+ * @param   size Indicator of how many bytes to send
+ * @param   incr DMASRCINCR_3 to walk the buffer, DMASRCINCR_0 to repeat it
+ * @return  None
+ ******************************************************************************/
+
+static void SDCard_startTx(const uint8_t *pBuffer, uint16_t size, uint16_t incr)
+{
+    DMA1SA = (uintptr_t)pBuffer;
+    DMA1SZ = size;
+    DMA1CTL = DMADT_0 + incr + DMASRCBYTE + DMADSTBYTE + DMAEN;
 
-    __bis_SR_register(gie);                                // Restore original GIE state
+    // The trigger is edge sensitive and TXIFG is already set while the USCI
+    // is idle, so toggle it to hand the channel its first request
+    UCB1IFG &= ~UCTXIFG;
+    UCB1IFG |= UCTXIFG;
 }
 
 /***************************************************************************//**
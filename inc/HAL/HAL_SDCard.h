@@ -41,8 +41,14 @@
 
 extern void SDCard_init(void);
 extern void SDCard_fastMode(void);
-extern void SDCard_readFrame(uint8_t *pBuffer, uint16_t size);
-extern void SDCard_sendFrame(uint8_t *pBuffer, uint16_t size);
+extern uint8_t SDCard_readFrame(uint8_t *pBuffer, uint16_t size);
+extern uint8_t SDCard_sendFrame(uint8_t *pBuffer, uint16_t size);
+extern void SDCard_readFrameDMA(uint8_t *pBuffer, uint16_t size);
+extern void SDCard_sendFrameDMA(uint8_t *pBuffer, uint16_t size);
+extern uint8_t SDCard_busy(void);
+extern uint8_t SDCard_wait(void);
+extern uint8_t SDCard_lendDMA(void);
+extern void SDCard_returnDMA(void);
 extern void SDCard_setCSHigh(void);
 extern void SDCard_setCSLow(void);
 
@@ -11,29 +11,507 @@ import time
 # How many channels
 channels = 10
 
-# Open the output file and write the header
-w = open('parsed.log', 'w+')
-w.write("EV Logger Parsed Log\n")
-w.write('Generated: ' + time.strftime("%c") + '\n')
-w.write('Frequency: 1kHz\n')
-w.write('ADC0, ADC1, ADC2, ADC3, ADC4, ADC5, ADC6, ACCELX, ACCELY, ACCELZ\n')
-w.write('\n')
-
-done = False
-
-with open("sample.log", "r") as f:
-    byte = f.read(2)
+# Logs that don't say what rate they were taken at are at 1kHz
+rate = 1000
+version = 0
+
+# Each raw record is one set of samples, unless the first word is 0xffff
+# (which the 12 bit ADC can never produce) in which case it is a gap record
+# giving the tick at which sample sets started being dropped and how many were
+# lost
+record = struct.Struct('<%dH' % channels)
+gap = struct.Struct('<HHLL')
+gap_marker = 0xffff
+lost = 0
+
+# Packed records are 14 bytes: seven 12 bit ADC results packed two to every
+# three bytes, a 4 bit tag in the top of byte 10 and three 8 bit accelerometer
+# readings. A tag of 0xf marks a gap, with the start tick and count in the
+# first 8 bytes.
+packed_len = 14
+packed_gap = 0xf
+adc_channels = 7
+
+# The number of ADC conversions in each tick, one for each ADC channel that is
+# enabled
+conversions = adc_channels
+
+# Newer logs are made up of 512 byte sectors, each starting with a header
+# (magic, layout, sequence number, first tick, record count and CRC) followed
+# by whole records. Older logs are just records one after the other.
+sector_len = 512
+header = struct.Struct('<HHLLHH')
+sector_magic = 0x5645
+layout_file = 0
+layout_raw = 1
+layout_packed = 2
+layout_rice = 3
+layout_tagged = 4
+record_len = {layout_raw: record.size, layout_packed: packed_len}
+
+# Tagged records hold only the channels that were due at that tick. They start
+# with a 16 bit word whose low bits are a bitmap of the channels present and
+# whose top 4 bits are the tag, followed by the present ADC results as a
+# stream of nibbles, least significant first (3 nibbles each, or 4 for
+# oversampled channels wider than 12 bits), padded to a byte and then the
+# present accelerometer readings. A gap is the word and then the start tick
+# and count. An accelerometer record (tag 1) is the word, a signed byte giving
+# the time of the reading in ADC conversions (conversions to a tick) from the
+# start of the tick of the next sample set, and the three readings.
+tagged_gap_len = 10
+tagged_accel = 1
+tagged_accel_len = 6
+
+# A timestamp record (tag 2, from version 5) is the word and a 32 bit time in
+# microseconds which stamps the record after it: for a sample set, when the
+# firmware started logging the block of sets it came from, and for an
+# accelerometer record, when the reading was signalled. The times wrap every
+# 2^32us. They are written to time.log along with how late each one is
+# compared to the sample schedule set by the first of them.
+tagged_time = 2
+tagged_time_len = 6
+stamp = None
+stamp_last = None
+anchor = None
+
+# A late marker (tag 0xe, from version 6) is laid out as a gap, but marks
+# sample sets that were taken and then thrown away because the firmware read
+# them too late to be sure they hadn't been written over
+tagged_late = 0xe
+
+# The first sector of a framed log describes the file: its header (layout 0,
+# no records) is followed by the format version, the logging frequency in Hz
+# and the numbers of ADC and accelerometer channels. From version 2 a divisor
+# for each channel follows, and the channel is only present at ticks which are
+# a multiple of it. From version 3 the width in bits of each channel follows
+# that, and channels wider than 12 bits are oversampled, which puts them at
+# ticks one less than a multiple of the divisor. From version 4 the
+# accelerometer channels have a divisor of 0 and are only in accelerometer
+# records, which are written to accel.log with their own times. From version 5
+# there may be timestamp records, and Rice coded gap markers are flagged 100.
+# From version 6 there may be late markers, and the Rice coded flag 100 is
+# followed by a bit which is set for a late marker rather than a gap. From
+# version 7 ADC channels may be disabled, which gives them a divisor of 0, and
+# only the enabled channels are converted in each tick. From version 8 a 32 bit
+# count follows the widths, which is non-zero if the log holds bursts captured
+# around a trigger. It is the number of sample sets logged after the set that
+# met the trigger, and the ticks between bursts aren't logged at all.
+file_info = struct.Struct('<HHHH')
+divisor = [1] * channels
+post = 0
+burst = None
+
+# Rice coded sectors are a bit stream rather than fixed size records, see
+# rice.c in the firmware for the format
+rice_esc = 16
+rice_acc_init = 16
+rice_acc_max = 0xffff
+rice_time_max = 8191
+widths = [12] * adc_channels + [8] * (channels - adc_channels)
+
+def present(i, tick):
+    """ Return whether channel i is logged at tick under the schedule """
+    if not divisor[i]:
+        return False
+    if widths[i] > 12:
+        return (tick + 1) % divisor[i] == 0
+    return tick % divisor[i] == 0
+
+def write_values(values):
+    """ Write out one sample set, leaving channels that weren't logged (None)
+    empty """
+    w.write(', '.join(['' if v is None else str(v) for v in values]) + '\n')
+
+def write_accel(tick, offset, values):
+    """ Write out an accelerometer reading taken offset ADC conversions from
+    the start of tick """
+    t = (tick + float(offset) / conversions) / rate
+    a.write('%.6f, ' % t + ', '.join([str(v) for v in values]) + '\n')
+
+def take_stamp(us):
+    """ Unwrap a timestamp, which is taken to be within 2^31us of the last one
+    (either way, as readings can be stamped before the block logged ahead of
+    them), and hold on to it for the record that follows """
+    global stamp, stamp_last
+    if stamp_last is not None:
+        d = (us - stamp_last) & 0xffffffff
+        us = stamp_last + (d - (1 << 32) if d & 0x80000000 else d)
+    stamp_last = us
+    stamp = us
+
+def write_stamp(kind, tick, offset=0):
+    """ Write out the timestamp held for a record, if there is one, where the
+    record is due offset ADC conversions from the start of tick """
+    global stamp, anchor
+    if stamp is None:
+        return
+    due = (tick + float(offset) / conversions) * 1e6 / rate
+    if anchor is None:
+        anchor = stamp - due
+    s.write('%d, %s, %d, %.1f\n' % (tick, kind, stamp, stamp - anchor - due))
+    stamp = None
+
+def signed(b):
+    """ Return the value of a two's complement byte """
+    return b - 256 if b & 0x80 else b
+
+def blank(count):
+    """ Write an empty line for each of count sample sets that are missing
+    such that every line of the parsed log is still exactly one sample period
+    """
+    for i in range(count):
+        w.write(', ' * (channels - 1) + '\n')
+
+def unpack(rec):
+    """ Unpack a packed record into a list of channel values, or None if it is
+    a gap marker """
+    b = [ord(c) for c in rec]
+    if b[10] >> 4 == packed_gap:
+        return None
+    values = []
+    for i in range(0, adc_channels, 2):
+        j = i / 2 * 3
+        values.append(b[j] | (b[j + 1] & 0x0f) << 8)
+        if i + 1 < adc_channels:
+            values.append(b[j + 1] >> 4 | b[j + 2] << 4)
+    return values + b[11:]
+
+def decode_tagged(sector, offset, tick):
+    """ Write out the tagged record at offset, which is before the sample set
+    at tick, and return the number of sample periods it covers and its length
+    """
+    global lost
+    b = [ord(c) for c in sector[offset:offset + 2]]
+    mask = b[0] | (b[1] & 0x0f) << 8
+    if b[1] >> 4 in (packed_gap, tagged_late):
+        start, count = struct.unpack('<LL', sector[offset + 2:offset + 10])
+        lost += count
+        if b[1] >> 4 == tagged_late:
+            print 'Late: %d sample sets discarded from tick %d' % (count, start)
+        else:
+            print 'Gap: %d sample sets lost from tick %d' % (count, start)
+        blank(count)
+        return count, tagged_gap_len
+    if b[1] >> 4 == tagged_accel:
+        b = [ord(c) for c in sector[offset + 2:offset + tagged_accel_len]]
+        write_stamp('accel', tick, signed(b[0]))
+        write_accel(tick, signed(b[0]), b[1:])
+        return 0, tagged_accel_len
+    if b[1] >> 4 == tagged_time:
+        take_stamp(struct.unpack('<L', sector[offset + 2:offset + 6])[0])
+        return 0, tagged_time_len
+    b = [ord(c) for c in sector[offset + 2:offset + 2 + 24]]
+    values = [None] * channels
+    nib = 0
+    for i in range(adc_channels):
+        if not mask & (1 << i):
+            continue
+        values[i] = 0
+        for k in range(4 if widths[i] > 12 else 3):
+            values[i] |= (b[nib >> 1] >> (nib & 1) * 4 & 0x0f) << 4 * k
+            nib += 1
+    j = (nib + 1) / 2
+    for i in range(adc_channels, channels):
+        if mask & (1 << i):
+            values[i] = b[j]
+            j += 1
+    write_stamp('sample', tick)
+    write_values(values)
+    return 1, 2 + j
+
+def decode(rec, layout=layout_raw):
+    """ Write out a single record and return the number of sample periods it
+    covers """
+    global lost
+    if layout == layout_packed:
+        values = unpack(rec)
+        is_gap = values is None
+    else:
+        values = record.unpack(rec)
+        is_gap = values[0] == gap_marker
+    if is_gap:
+        start, count = struct.unpack('<LL', rec[:8]) if layout == layout_packed \
+            else gap.unpack(rec[:gap.size])[2:]
+        lost += count
+        print 'Gap: %d sample sets lost from tick %d' % (count, start)
+        blank(count)
+        return count
+    write_values(values)
+    return 1
+
+class BitReader:
+    """ Read a stream of bits, most significant bit of each byte first """
+    def __init__(self, data):
+        self.data = data
+        self.bit = 0
+
+    def read(self, n):
+        v = 0
+        for i in range(n):
+            byte = ord(self.data[self.bit >> 3])
+            v = (v << 1) | ((byte >> (7 - (self.bit & 7))) & 1)
+            self.bit += 1
+        return v
+
+    def ones(self, limit):
+        """ Count one bits up to and including the terminating zero, stopping
+        early if limit ones are read """
+        n = 0
+        while n < limit and self.read(1):
+            n += 1
+        return n
+
+def rice_k(acc):
+    k = 0
+    while k < 12 and (4 << k) <= acc:
+        k += 1
+    return k
+
+def rice_average(acc, z):
+    """ Return a running average updated with a coded value, held at
+    rice_acc_max as the firmware does """
+    return min(acc - (acc >> 2) + z, rice_acc_max)
+
+def decode_rice_values(bits, mask, prev, acc):
+    """ Read the coded values of the channels in mask, updating the
+    previous values and running averages, and return all of the channels with
+    None for those that aren't present """
+    values = [None] * channels
+    for i in range(channels):
+        if not mask[i]:
+            continue
+        if prev[i] is None:
+            values[i] = bits.read(widths[i])
+        else:
+            k = rice_k(acc[i])
+            q = bits.ones(rice_esc)
+            if q == rice_esc:
+                v = bits.read(widths[i])
+                d = v - prev[i]
+                z = 2 * d if d >= 0 else -2 * d - 1
+            else:
+                z = (q << k) | bits.read(k)
+                d = z / 2 if z % 2 == 0 else -(z + 1) / 2
+                v = prev[i] + d
+            acc[i] = rice_average(acc[i], z)
+            values[i] = v
+        prev[i] = values[i]
+    return values
+
+def decode_rice_time(bits, state):
+    """ Read a coded timestamp, updating the sector's timestamp state (the
+    number of timestamps so far, the last one, the step to it and the running
+    average), and return it """
+    have, prev, step, acc = state
+    us = None
+    if have > 1:
+        k = rice_k(acc)
+        q = bits.ones(rice_esc)
+        if q < rice_esc:
+            z = (q << k) | bits.read(k)
+            d = z / 2 if z % 2 == 0 else -(z + 1) / 2
+            us = (prev + step + d) & 0xffffffff
+    if us is None:
+        us = bits.read(32)
+    d = (us - prev - step) & 0xffffffff
+    d = d - (1 << 32) if d & 0x80000000 else d
+    if have > 1 and abs(d) <= rice_time_max:
+        acc = rice_average(acc, 2 * d if d >= 0 else -2 * d - 1)
+    state[:] = [min(have + 1, 2), us, (us - prev) & 0xffffffff, acc]
+    return us
+
+def decode_rice(sector, tick, count):
+    """ Write out each record in a Rice coded sector, the first of which is at
+    tick, and return the number of sample periods they cover """
+    global lost
+    bits = BitReader(sector[header.size:])
+    prev = [None] * channels
+    acc = [rice_acc_init] * channels
+    periods = 0
+    accel = [i >= adc_channels and not d for i, d in enumerate(divisor)]
+    times = [0, 0, 0, rice_acc_init]
+    for r in range(count):
+        if bits.read(1):
+            # Before version 4 a one bit was always a gap
+            if version >= 4 and bits.read(1):
+                offset = signed(bits.read(8))
+                values = decode_rice_values(bits, accel, prev, acc)
+                write_stamp('accel', tick + periods, offset)
+                write_accel(tick + periods, offset, values[adc_channels:])
+                continue
+            # And before version 5 so was 10
+            if version >= 5 and bits.read(1):
+                take_stamp(decode_rice_time(bits, times))
+                continue
+            late = version >= 6 and bits.read(1)
+            start = bits.read(32)
+            count = bits.read(32)
+            lost += count
+            if late:
+                print 'Late: %d sample sets discarded from tick %d' % (count,
+                        start)
+            else:
+                print 'Gap: %d sample sets lost from tick %d' % (count, start)
+            blank(count)
+            periods += count
+            continue
+        # Which channels are present follows from the schedule
+        values = decode_rice_values(bits, [present(i, tick + periods)
+            for i in range(channels)], prev, acc)
+        write_stamp('sample', tick + periods)
+        write_values(values)
+        periods += 1
+    return periods
+
+def crc16(data):
+    """ CRC-16-CCITT (polynomial 0x1021, initial value 0xffff) as calculated
+    by the MSP430 CRC module """
+    crc = 0xffff
+    for c in data:
+        crc ^= ord(c) << 8
+        for i in range(8):
+            if crc & 0x8000:
+                crc = ((crc << 1) ^ 0x1021) & 0xffff
+            else:
+                crc = (crc << 1) & 0xffff
+    return crc
+
+def write_header():
+    """ Open the output files and write their headers """
+    global w, a, s
+    w = open('parsed.log', 'w+')
+    a = open('accel.log', 'w+')
+    a.write('Time (s), ACCELX, ACCELY, ACCELZ\n')
+    s = open('time.log', 'w+')
+    s.write('Tick, Record, Time (us), Late (us)\n')
+    w.write("EV Logger Parsed Log\n")
+    w.write('Generated: ' + time.strftime("%c") + '\n')
+    w.write('Frequency: %dHz\n' % rate)
+    names = ['ADC%d' % i for i in range(adc_channels)] + \
+        ['ACCELX', 'ACCELY', 'ACCELZ']
+    # Oversampled channels have more than the usual 12 bits
+    for i in range(adc_channels):
+        if widths[i] > 12:
+            names[i] += ' (%d bit)' % widths[i]
+        if not divisor[i]:
+            names[i] += ' (off)'
+    w.write(', '.join(names) + '\n')
+    w.write('\n')
+
+def read_info(f):
+    """ Read the logging frequency and channel schedule from the file
+    information sector, if the log starts with one """
+    global version, rate, divisor, widths, conversions, post
+    sector = f.read(sector_len)
+    f.seek(0)
+    if len(sector) < sector_len:
+        return
+    magic, layout = struct.unpack('<HH', sector[:4])
+    zeroed = sector[:header.size - 2] + '\0\0' + sector[header.size:]
+    if magic != sector_magic or layout != layout_file \
+            or crc16(zeroed) != header.unpack(sector[:header.size])[5]:
+        return
+    version, rate, adcs, accels = file_info.unpack(
+            sector[header.size:header.size + file_info.size])
+    if adcs + accels != channels:
+        print 'Warning: log has %d channels, expected %d' % (adcs + accels,
+                channels)
+    if version >= 2:
+        offset = header.size + file_info.size
+        divisor = [ord(c) for c in sector[offset:offset + channels]]
+        conversions = len([d for d in divisor[:adc_channels] if d])
+    if version >= 3:
+        offset = header.size + file_info.size + channels
+        widths = [ord(c) for c in sector[offset:offset + channels]]
+    if version >= 8:
+        offset = header.size + file_info.size + 2 * channels
+        post = struct.unpack('<L', sector[offset:offset + 4])[0]
+
+def start_burst(tick, end):
+    """ Start a new burst of a captured log at tick, reporting the one before
+    it, which ended before end, if there was one """
+    global burst
+    end_burst(end)
+    print 'Burst from tick %d' % tick
+    w.write('Burst from tick %d\n' % tick)
+    burst = tick
+
+def end_burst(tick):
+    """ Report the burst of a captured log that ends before tick, the last
+    post sets of which were logged after its trigger """
+    if burst is not None:
+        print 'Burst: ticks %d to %d, trigger at tick %d' % (burst, tick - 1,
+                tick - 1 - post)
+
+def parse_sectors(f):
+    """ Parse a log made of framed sectors. Sectors which fail their CRC are
+    skipped, and the tick in the next good header tells us how much data was
+    lost with them """
+    global lost, stamp
+    tick = 0
     while 1:
-        for i in range(channels):
-            # Swap the byte order here
-            a = struct.pack('<h', *struct.unpack('>h', byte))
-            w.write(str(int(a.encode("hex"), 16)))
-            if i < (channels - 1):
-                w.write(', ')
-            byte = f.read(2)
-            if not byte:
-                done = True
-        if done:
+        sector = f.read(sector_len)
+        if len(sector) < sector_len:
             break
-        w.write('\n')
-    w.close()
+        magic, layout, seq, first, count, crc = header.unpack(sector[:header.size])
+        zeroed = sector[:header.size - 2] + '\0\0' + sector[header.size:]
+        if magic != sector_magic or crc16(zeroed) != crc \
+                or (layout not in record_len
+                    and layout not in (layout_rice, layout_tagged, layout_file)):
+            print 'Bad sector at offset %d, skipping' % (f.tell() - sector_len)
+            # A timestamp at the end of the last sector was for a record in
+            # this one
+            stamp = None
+            continue
+        if layout == layout_file:
+            continue
+        # The ticks between bursts weren't logged, rather than lost
+        if post and (burst is None or first != tick):
+            start_burst(first, tick)
+            tick = first
+        if first != tick:
+            print 'Sectors missing: %d sample sets lost from tick %d' % (first - tick, tick)
+            lost += first - tick
+            blank(first - tick)
+            tick = first
+        if layout == layout_rice:
+            tick += decode_rice(sector, first, count)
+            continue
+        if layout == layout_tagged:
+            offset = header.size
+            for i in range(count):
+                periods, size = decode_tagged(sector, offset, tick)
+                tick += periods
+                offset += size
+            continue
+        size = record_len[layout]
+        for i in range(count):
+            offset = header.size + i * size
+            tick += decode(sector[offset:offset + size], layout)
+    if post:
+        end_burst(tick)
+
+def parse_raw(f):
+    """ Parse a log with no framing """
+    while 1:
+        rec = f.read(record.size)
+        if len(rec) < record.size:
+            break
+        decode(rec)
+
+with open("sample.log", "rb") as f:
+    magic = struct.unpack('<H', f.read(2))[0]
+    f.seek(0)
+    if magic == sector_magic:
+        read_info(f)
+        write_header()
+        parse_sectors(f)
+    else:
+        write_header()
+        parse_raw(f)
+w.close()
+a.close()
+s.close()
+
+if lost:
+    print 'Total sample sets lost: %d' % lost
@@ -0,0 +1,179 @@
+###############################
+# EV Datalogger Project
+# Jon Sowman 2014
+# University of Southampton
+# All Rights Reserved
+###############################
+
+# Measure how well the firmware's Rice coder (rice.c) compresses a log of
+# unframed raw records such as sample.log, by running the same coder over it
+# and counting the sectors it produces. The firmware reports the cycles it
+# spends per sector over the UART when each file is closed. The log is taken
+# to be at 1kHz with the firmware's default channel schedule, under which the
+# potentiometer (ADC6) is oversampled 16 times to give 14 bit results. The
+# accelerometer is logged in its own records at 400Hz, each reading taken from
+# the set of samples at the tick it falls in, and the first set of each block of
+# two is timestamped (LOG_STAMP_BLOCK) with the stamps taken to be exactly on
+# time.
+
+import struct
+import sys
+
+channels = 10
+adc_channels = 7
+raw_widths = [12] * adc_channels + [8] * (channels - adc_channels)
+shift = [0] * (adc_channels - 1) + [2] + [0] * (channels - adc_channels)
+widths = [n + s for n, s in zip(raw_widths, shift)]
+divisor = [1 << 2 * s if s else 1 for s in shift[:adc_channels]] + \
+    [0] * (channels - adc_channels)
+accel = [not d for d in divisor]
+accel_hz = 400
+rate = 1000
+block = 2
+stamp = [False] * channels
+
+sector_len = 512
+header_len = 16
+rice_esc = 16
+rice_acc_init = 16
+rice_acc_max = 0xffff
+
+def rice_k(acc):
+    k = 0
+    while k < 12 and (4 << k) <= acc:
+        k += 1
+    return k
+
+def rice_average(acc, z):
+    """ Return a running average updated with a coded value, held at
+    rice_acc_max as the firmware does """
+    return min(acc - (acc >> 2) + z, rice_acc_max)
+
+def tagged_len(mask):
+    """ Return the length of a tagged record holding the channels in mask """
+    if mask == accel:
+        return 3 + channels - adc_channels
+    if mask == stamp:
+        return 6
+    return sample_len(mask)
+
+def sample_len(mask):
+    """ Return the length of a tagged set of samples holding the channels in
+    mask """
+    nibbles = sum([4 if widths[i] > 12 else 3 for i in range(adc_channels)
+        if mask[i]])
+    return 2 + (nibbles + 1) / 2 + len([m for m in mask[adc_channels:] if m])
+
+def stamp_bits(have, acc):
+    """ Return the number of bits needed to code a timestamp that is exactly a
+    block after the last one, following rice_time(), and the updated running
+    average """
+    if have < 2:
+        return 35, acc
+    return 3 + 1 + rice_k(acc), rice_average(acc, 0)
+
+def rice_bits(values, mask, prev, acc):
+    """ Return the number of bits needed to code a set of samples or an
+    accelerometer reading and the updated running averages, following
+    rice_values() """
+    bits = 10 if mask == accel else 1
+    acc = list(acc)
+    for i in range(channels):
+        if not mask[i]:
+            continue
+        if prev[i] is None:
+            bits += widths[i]
+            continue
+        d = values[i] - prev[i]
+        z = 2 * d if d >= 0 else -2 * d - 1
+        k = rice_k(acc[i])
+        q = z >> k
+        bits += q + 1 + k if q < rice_esc else rice_esc + widths[i]
+        acc[i] = rice_average(acc[i], z)
+    return bits, acc
+
+record = struct.Struct('<%dH' % channels)
+name = sys.argv[1] if len(sys.argv) > 1 else 'sample.log'
+sets = []
+with open(name, 'rb') as f:
+    while 1:
+        rec = f.read(record.size)
+        if len(rec) < record.size:
+            break
+        values = list(record.unpack(rec))
+        sets.append([v & ((1 << n) - 1) for v, n in zip(values, raw_widths)])
+
+def records():
+    """ Generate the values and channel mask of each record in turn, with
+    each accelerometer reading ahead of the set of samples at its tick """
+    sums = [0] * channels
+    reading = 0
+    for tick, values in enumerate(sets):
+        while reading * rate < (tick + 1) * accel_hz:
+            yield values, accel
+            reading += 1
+        if tick % block == 0:
+            yield values, stamp
+        # Oversampled channels are logged once they have a full set of
+        # samples, as their sum shifted down
+        mask = [bool(n) and (tick + 1 if s else tick) % n == 0
+                for n, s in zip(divisor, shift)]
+        sums = [a + v if s else 0 for a, v, s in zip(sums, values, shift)]
+        values = [a >> s if s else v for a, v, s in zip(sums, values, shift)]
+        sums = [0 if m else a for a, m in zip(sums, mask)]
+        yield values, mask
+
+# Fill sectors exactly as the firmware does, starting a new sector (with each
+# channel's first value at full width) whenever the next record doesn't fit
+space = (sector_len - header_len) * 8
+sectors = 0
+bit = space
+prev = [None] * channels
+acc = [rice_acc_init] * channels
+have_us, us_acc = 0, rice_acc_init
+tagged = 0
+fill = sector_len
+held = 0
+for values, mask in records():
+    # A stamp always goes into the same tagged sector as the record after it
+    n = held + tagged_len(mask)
+    held = n if mask == stamp else 0
+    if not held and fill + n > sector_len:
+        tagged += 1
+        fill = header_len
+    if not held:
+        fill += n
+    if mask == stamp:
+        bits, new_acc = stamp_bits(have_us, us_acc)
+        if bit + bits > space:
+            sectors += 1
+            bit = 0
+            prev = [None] * channels
+            acc = [rice_acc_init] * channels
+            have_us, us_acc = 0, rice_acc_init
+            bits, new_acc = stamp_bits(have_us, us_acc)
+        bit += bits
+        have_us = min(have_us + 1, 2)
+        us_acc = new_acc
+        continue
+    bits, new_acc = rice_bits(values, mask, prev, acc)
+    if bit + bits > space:
+        sectors += 1
+        bit = 0
+        prev = [None] * channels
+        acc = [rice_acc_init] * channels
+        have_us, us_acc = 0, rice_acc_init
+        bits, new_acc = rice_bits(values, mask, prev, acc)
+    bit += bits
+    prev = [v if m else p for v, m, p in zip(values, mask, prev)]
+    acc = new_acc
+
+print 'Sample sets:     %d' % len(sets)
+print 'Raw:             %d bytes' % (len(sets) * record.size)
+print 'Tagged sectors:  %d (%d bytes)' % (tagged, tagged * sector_len)
+print 'Rice sectors:    %d (%d bytes)' % (sectors, sectors * sector_len)
+print 'Sets per sector: %.1f tagged, %.1f Rice' % (float(len(sets)) / tagged,
+        float(len(sets)) / sectors)
+print 'Ratio:           %.1f%% of tagged, %.1f%% of raw' % (
+        100.0 * sectors / tagged, 100.0 * sectors * sector_len /
+        (len(sets) * record.size))
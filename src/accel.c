@@ -6,6 +6,9 @@
  * code) buit is heavily modified to use a finite state machine (FSM) type
  * approach to getting data from the accelerometer such that very little CPU
  * time is required (since the logger is typically busy with other things).
+ * Where possible the whole read is done by DMA instead, using the channels
+ * that the SD card driver lends out between its own transfers, which costs
+ * one interrupt rather than one for every byte.
  *
  *  HAL_Cma3000.c - Code for using the CMA3000-D01 3-Axis Ultra Low Power
  *                  Accelerometer
@@ -49,6 +52,7 @@
 #include <inttypes.h>
 #include "msp430.h"
 #include "accel.h"
+#include "HAL_SDCard.h"
 #include "system.h"
 #include "uart.h"
 
@@ -62,6 +66,18 @@ int8_t Cma3000_zAccel;
 // Maintain a pointer to the SampleBuffer
 static volatile SampleBuffer *sb;
 
+// Called from the ISR once each reading has been read into the SampleBuffer
+static void (*read_done)(void);
+
+// The bytes clocked out to read each channel in a single frame: the address
+// of its register and then a dummy byte while the value comes back
+static const uint8_t accel_cmd[2 * ACCEL_CHANNELS] =
+{
+    DOUTX << 2, 0,
+    DOUTY << 2, 0,
+    DOUTZ << 2, 0
+};
+
 /**
  * Contain the current accelerometer state. This is volatile since it is
  * modified in the interrupt service routine.
@@ -70,13 +86,25 @@ static volatile accel_state_t accel_state;
 
 /**
  * Configures the CMA3000-D01 3-Axis Ultra Low Power Accelerometer
+ *
+ * The INT pin goes high whenever a new reading is ready (ACCEL_DATA_HZ) and
+ * low again once it has been read, and its rising edge is enabled as an
+ * interrupt. The owner of PORT2_VECTOR should start Cma3000_readAccelFSM() on
+ * each edge.
+ *
+ * Each read fills SampleBuffer::accel with the whole SPI frame, see
+ * Cma3000_startRead().
+ *
  * @param samplebuffer The SampleBuffer in which to place accelerometer data
  * samples.
+ * @param done A function to be called from the USCI ISR each time the FSM has
+ * read a full set of data into the SampleBuffer, or NULL
  */
-void Cma3000_init(volatile SampleBuffer *samplebuffer)
+void Cma3000_init(volatile SampleBuffer *samplebuffer, void (*done)(void))
 {
     uint8_t i;
     sb = samplebuffer;
+    read_done = done;
     
     do
     {
@@ -134,11 +162,15 @@ void Cma3000_init(volatile SampleBuffer *samplebuffer)
     } while (!(ACCEL_INT_IN & ACCEL_INT));
 
     // Clear the sample buffer accelerometer data
-    for(i=0; i < ACCEL_CHANNELS; i++)
+    for(i=0; i < sizeof(sb->accel); i++)
         sb->accel[i] = 0;
 
-    // Fire an interrupt when we get a new char
-    UCA0IE |= UCRXIE;
+    // Interrupt on each new reading. INT is already high from the settling
+    // check, so read it once to let it fall again, otherwise there will never
+    // be an edge.
+    ACCEL_INT_IFG &= ~ACCEL_INT;
+    ACCEL_INT_IE |= ACCEL_INT;
+    Cma3000_readAccel();
 }
 
 /**
@@ -238,12 +270,18 @@ int8_t Cma3000_readRegister(uint8_t Address)
 }
 
 /**
- * Commence reading of data into the SampleBuffer
+ * Commence reading of data into the SampleBuffer, a byte at a time from the
+ * USCI ISR. This should only be called while the FSM is idle
+ * (STATE_ACCEL_NONE or STATE_ACCEL_DONE).
  */
 void Cma3000_readAccelFSM(void)
 {
     accel_state = STATE_ACCEL_NONE;
 
+    // Fire an interrupt when we get a new char
+    UCA0IFG &= ~UCRXIFG;
+    UCA0IE |= UCRXIE;
+
     // Assert CS
     ACCEL_OUT &= ~ACCEL_CS;
 
@@ -254,6 +292,69 @@ void Cma3000_readAccelFSM(void)
     accel_state = STATE_ACCEL_XREQ;
 }
 
+/**
+ * Commence reading of data into the SampleBuffer. The whole frame is moved
+ * by DMA if the SD card driver can lend us DMA channels 1 and 2, otherwise
+ * the FSM is used (see Cma3000_readAccelFSM()). Either way the done function
+ * passed to Cma3000_init() is called once there is a full set of data. This
+ * should only be called while the FSM is idle.
+ */
+void Cma3000_startRead(void)
+{
+    if(!SDCard_lendDMA())
+    {
+        Cma3000_readAccelFSM();
+        return;
+    }
+    accel_state = STATE_ACCEL_DMA;
+
+    // Discard any stale byte so that RXIFG only fires for this frame
+    UCA0RXBUF;
+    UCA0IFG &= ~UCRXIFG;
+
+    // Channel 2 moves each byte received into the SampleBuffer and
+    // interrupts at the end of the frame
+    DMACTL1 = (DMACTL1 & ~DMA2TSEL_31) | DMA2TSEL_16;     // UCA0RXIFG
+    DMA2SA = (uintptr_t)&UCA0RXBUF;
+    DMA2DA = (uintptr_t)sb->accel;
+    DMA2SZ = sizeof(accel_cmd);
+    DMA2CTL = DMADT_0 | DMADSTINCR_3 | DMASRCBYTE | DMADSTBYTE | DMAIE | DMAEN;
+
+    // Channel 1 clocks out the commands
+    DMACTL0 = (DMACTL0 & ~DMA1TSEL_31) | DMA1TSEL_17;     // UCA0TXIFG
+    DMA1SA = (uintptr_t)accel_cmd;
+    DMA1DA = (uintptr_t)&UCA0TXBUF;
+    DMA1SZ = sizeof(accel_cmd);
+    DMA1CTL = DMADT_0 | DMASRCINCR_3 | DMASRCBYTE | DMADSTBYTE | DMAEN;
+
+    // Assert CS
+    ACCEL_OUT &= ~ACCEL_CS;
+
+    // The trigger is edge sensitive and TXIFG is already set while the USCI
+    // is idle, so toggle it to hand channel 1 its first request
+    UCA0IFG &= ~UCTXIFG;
+    UCA0IFG |= UCTXIFG;
+}
+
+/**
+ * Finish a read that was started by DMA, once channel 2 has moved the last
+ * byte of the frame (and so the frame is over). The owner of DMA_VECTOR
+ * should call this on each DMA channel 2 interrupt.
+ */
+void Cma3000_dmaDone(void)
+{
+    if(accel_state != STATE_ACCEL_DMA)
+        return;
+
+    // Deselect acceleration sensor and give the channels back
+    ACCEL_OUT |= ACCEL_CS;
+    SDCard_returnDMA();
+
+    accel_state = STATE_ACCEL_DONE;
+    if(read_done)
+        read_done();
+}
+
 /**
  * Get the current state of the accelerometer
  * \returns The current state as an accel_state_t.
@@ -340,7 +441,7 @@ interrupt(USCI_A0_VECTOR) USCI_A0_ISR(void)
                     break;
                 case STATE_ACCEL_XRDY:
                     // We've got data x, store it and move to y
-                    sb->accel[0] = UCA0RXBUF;
+                    sb->accel[1] = UCA0RXBUF;
                     UCA0TXBUF = DOUTY << 2;
                     accel_state = STATE_ACCEL_YREQ;
                     break;
@@ -351,7 +452,7 @@ interrupt(USCI_A0_VECTOR) USCI_A0_ISR(void)
                     break;
                 case STATE_ACCEL_YRDY:
                     // We've got y, store it and move to z
-                    sb->accel[1] = UCA0RXBUF;
+                    sb->accel[3] = UCA0RXBUF;
                     UCA0TXBUF = DOUTZ << 2;
                     accel_state = STATE_ACCEL_ZREQ;
                     break;
@@ -362,10 +463,13 @@ interrupt(USCI_A0_VECTOR) USCI_A0_ISR(void)
                     break;
                 case STATE_ACCEL_ZRDY:
                     // We've got z, store it and finish
-                    sb->accel[2] = UCA0RXBUF;
+                    sb->accel[5] = UCA0RXBUF;
                     accel_state = STATE_ACCEL_DONE;
                     // Deselect acceleration sensor
                     ACCEL_OUT |= ACCEL_CS;
+                    UCA0IE &= ~UCRXIE;
+                    if(read_done)
+                        read_done();
                     break;
                 default: break;
             }
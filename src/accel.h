@@ -53,6 +53,10 @@
 // CONSTANTS
 #define TICKSPERUS              (F_CPU/ 1000000)
 
+// Rate at which new readings are produced in measurement mode (MODE_400),
+// each one raising the INT pin
+#define ACCEL_DATA_HZ           400
+
 // PORT DEFINITIONS
 #define ACCEL_INT_IN            P2IN
 #define ACCEL_INT_OUT           P2OUT
@@ -117,14 +121,19 @@ typedef enum accel_state_t
     STATE_ACCEL_ZRDY,
     /// We have completed, there is a full set of valid data in the
     /// SampleBuffer
-    STATE_ACCEL_DONE
+    STATE_ACCEL_DONE,
+    /// DMA is moving all of the data values into the SampleBuffer
+    STATE_ACCEL_DMA
 } accel_state_t;
 
-extern void Cma3000_init(volatile SampleBuffer *samplebuffer);
+extern void Cma3000_init(volatile SampleBuffer *samplebuffer,
+        void (*done)(void));
 extern void Cma3000_disable(void);
 extern void Cma3000_readAccel(void);
 extern int8_t Cma3000_readRegister(uint8_t Address);
 void Cma3000_readAccelFSM(void);
+void Cma3000_startRead(void);
+void Cma3000_dmaDone(void);
 accel_state_t Cma3000_getState(void);
 extern int8_t Cma3000_writeRegister(uint8_t Address, int8_t Data);
 
@@ -3,10 +3,24 @@
  * converter unit, plus starting conversions and post-handling the conversion
  * results.
  *
- * We use DMA channel 0 to move results from the ADC conversion memory into a
- * SampleBuffer once the conversion has completed, such that the CPU need only
- * request the beginning of a conversion run and some time later, the results
- * will appear in the SampleBuffer that the CPU specified.
+ * Conversions are started by the hardware rather than the CPU. Timer A0
+ * output 1 (TA0.1) is the sample-and-hold trigger, and each of its rising
+ * edges converts the next channel of a repeating sequence. Only the channels
+ * that are enabled (see adc_set_channels()) are in the sequence. The logger
+ * runs TA0 at one edge per enabled channel per tick, so every channel is
+ * sampled at exactly the logging frequency whatever interrupts are doing. The
+ * channels of one set are spread evenly through the tick rather than taken
+ * back to back.
+ *
+ * The sequence covers ADC_BLOCK sets of samples, using one conversion memory
+ * for each enabled channel of each set. At the end of each sequence, DMA
+ * channel 0 moves the whole block into the SampleBuffer and interrupts the
+ * CPU, so the CPU is woken once per block rather than once per set.
+ *
+ * The SampleBuffer holds two blocks, and successive blocks go into
+ * alternate halves of it (see adc_swap()). Whilst the CPU is reading one half
+ * the DMA is filling the other, so a block isn't written over until the one
+ * after next.
  *
  * @file adc.c
  * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
@@ -19,79 +33,166 @@
 #include "adc.h"
 #include "system.h"
 
+/**
+ * The analogue input for each channel. A6, A7, A12, A13, A14, A15 are broken
+ * out and A5 is the potentiometer, all with AVCC as +ve and AVSS as -ve.
+ */
+static const uint8_t adc_inputs[ADC_CHANNELS] = {ADC12INCH_6, ADC12INCH_7,
+    ADC12INCH_12, ADC12INCH_13, ADC12INCH_14, ADC12INCH_15, ADC12INCH_5};
+
+/// The sample buffer that DMA fills, and the half of it that the block being
+/// converted will go into.
+static volatile SampleBuffer *adc_sb;
+static uint8_t adc_half;
+
 /**
  * Set up the ADC clock and configure resolution, then enable the ADC
- * unit. Configure the memory channels to physical inputs. Configure the DMA
- * unit on DMA channel 0 to automatically move data from the ADC conversion
- * memory into the sample buffer at the end of each conversion run.
+ * unit. Configure the memory channels to physical inputs, with all channels
+ * enabled, and TA0.1 as the conversion trigger. Configure the DMA unit on DMA
+ * channel 0 to automatically move data from the ADC conversion memory into
+ * the sample buffer at the end of each block, and to interrupt when it has
+ * done so. Conversions don't begin until adc_start() is called.
  *
  * @param sb A pointer to the sample buffer into which we will put ADC
  * readings.
  */
 void adc_init(volatile SampleBuffer *sb)
 {
-    uint8_t i;
+    uint8_t i, h;
 
     // Clear the ADC sample buffer
-    for(i = 0; i < ADC_CHANNELS; i++)
-        sb->adc[i] = 0;
+    adc_sb = sb;
+    for(h = 0; h < 2; h++)
+        for(i = 0; i < ADC_MEMS; i++)
+            sb->adc[h][i] = 0;
 
     // Be sure that conversions are disabled
     ADC12CTL0 &= ~ADC12ENC;
 
     // Need 4us conversion time for 12 bit resolution and 10kR source
     // resistance. This is 20 cycles at 5MHz ADC12CLK, round up to 32
-    // Enable ADC12 and use multiple-sample-conversion mode
-    ADC12CTL0 |= ADC12ON | ADC12MSC | ADC12SHT0_3 | ADC12SHT1_3;
+    // Enable ADC12, without multiple-sample-conversion so that each
+    // conversion waits for its own trigger
+    ADC12CTL0 |= ADC12ON | ADC12SHT0_3 | ADC12SHT1_3;
 
     // If using external reference or AVCC then we can have 5MHz maximum
     // ADC12CLK, so divide by 5 to get 5MHz from 25MHz SMCLK
-    // Use the sampling timer (SHP) and sequential conversion mode
-    ADC12CTL1 |= ADC12DIV_4 | ADC12SSEL_3 | ADC12SHP | ADC12CONSEQ_1;
-
-    // A6, A7, A12, A13, A14, A15 are broken out, set these as sources for
-    // ADC12MEM0-5 with AVCC as +ve and AVSS as -ve
-    ADC12MCTL0 = ADC12INCH_6;
-    ADC12MCTL1 = ADC12INCH_7;
-    ADC12MCTL2 = ADC12INCH_12;
-    ADC12MCTL3 = ADC12INCH_13;
-    ADC12MCTL4 = ADC12INCH_14;
-    ADC12MCTL5 = ADC12INCH_15;
-    // Set end of sequence (EOS) for final channel
-    ADC12MCTL6 = ADC12INCH_5 | ADC12EOS;
-
-    // Enable conversions last, can't modify ADC12ON whilst ADC12ENC=1
-    ADC12CTL0 |= ADC12ENC;
+    // Use the sampling timer (SHP) triggered from TA0.1 and repeated
+    // sequential conversion mode
+    ADC12CTL1 |= ADC12DIV_4 | ADC12SSEL_3 | ADC12SHP | ADC12SHS_1
+        | ADC12CONSEQ_3;
 
     // Now set up DMA to transfer ADC readings to the ADC buffer
-    // Set DMA channel 0 trigger to ADC12IFGx
+    // Set DMA channel 0 trigger to ADC12IFGx, which in sequence modes is
+    // the flag of the final conversion of the sequence
     DMACTL0 |= DMA0TSEL_24;
 
     // Don't let DMA interrupt read-modify-write CPU operations
     DMACTL4 |= DMARMWDIS;
 
-    // Select block transfer, increment both source and dest addresses
-    DMA0CTL |= DMADT_1 | DMADSTINCR_3 | DMASRCINCR_3;
+    // Select repeated block transfer, increment both source and dest
+    // addresses, and interrupt at the end of each block
+    DMA0CTL |= DMADT_5 | DMADSTINCR_3 | DMASRCINCR_3 | DMAIE;
 
-    // Set source address to first ADC conversion memory, destination to ADC
-    // buffer, transfer 6 words (6 channels)
+    // Set source address to first ADC conversion memory, destination to the
+    // first half of the ADC buffer
     DMA0SA = (uintptr_t)&ADC12MEM0;
-    DMA0DA = (uintptr_t)(sb->adc);
-    DMA0SZ = ADC_CHANNELS;
+    DMA0DA = (uintptr_t)(sb->adc[0]);
+    adc_set_channels(LOG_ADC_MASK);
 }
 
 /**
- * Enable DMA on channel 0 which will move data to the sample buffer
- * after the ADC conversion run has completed, then begin the conversion
- * run.
+ * Choose which channels are converted, by building the conversion sequence
+ * out of just those channels and sizing the DMA block to match. The results
+ * of each set are packed into the SampleBuffer in channel order, with no
+ * space for the channels that are left out. Conversions must be stopped (see
+ * adc_stop()) whilst this is done.
+ *
+ * @param mask Channel bitmap of the ADC channels to convert, which must not
+ * be empty
+ * @returns The number of channels enabled, which is the number of
+ * conversions in each set
  */
-void adc_convert(void)
+uint8_t adc_set_channels(uint16_t mask)
 {
-    // Enable DMA on Channel 0
+    volatile uint8_t *mctl = &ADC12MCTL0;
+    uint8_t inputs[ADC_CHANNELS];
+    uint8_t i, j, n = 0;
+
+    for(i = 0; i < ADC_CHANNELS; i++)
+        if(mask & (1U << i))
+            inputs[n++] = adc_inputs[i];
+
+    // Each set of samples in the block has its own run of memories
+    for(j = 0; j < ADC_BLOCK; j++)
+        for(i = 0; i < n; i++)
+            mctl[j * n + i] = inputs[i];
+
+    // Set end of sequence (EOS) for final channel of the final set
+    mctl[n * ADC_BLOCK - 1] |= ADC12EOS;
+
+    // Transfer a word for every memory in the sequence
+    DMA0SZ = n * ADC_BLOCK;
+    return n;
+}
+
+/**
+ * Begin converting a fresh sequence on each TA0.1 trigger, with the DMA ready
+ * to move it to the sample buffer. Any sequence that was part way through is
+ * abandoned so that the first conversion is always of the first channel.
+ */
+void adc_start(void)
+{
+    adc_stop();
+
+    // Clear out any results left over and re-arm the DMA, which reloads its
+    // addresses and count, to fill the first half of the buffer first. The
+    // block after that is reloaded from DMA0DA at the end of the first one,
+    // so point it at the second half.
+    ADC12IFG = 0;
+    adc_half = 0;
+    DMA0DA = (uintptr_t)(adc_sb->adc[0]);
     DMA0CTL |= DMAEN;
+    DMA0DA = (uintptr_t)(adc_sb->adc[1]);
+
+    ADC12CTL1 |= ADC12CONSEQ_3;
+    ADC12CTL0 |= ADC12ENC;
+}
+
+/**
+ * Stop conversions immediately, even part way through a sequence, and
+ * disable the DMA.
+ */
+void adc_stop(void)
+{
+    ADC12CTL0 &= ~ADC12ENC;
+    ADC12CTL1 &= ~ADC12CONSEQ_3;
+    DMA0CTL &= ~DMAEN;
+}
+
+/**
+ * Take the half of the sample buffer that DMA has just finished filling. This
+ * must be called exactly once for each block, from the DMA interrupt.
+ *
+ * In repeated block mode the DMA reloads its destination from DMA0DA at the
+ * start of each block, so by the time we are interrupted the next block is
+ * already going into the other half. The half we hand out is made the
+ * destination for the block after that, which gives the caller until the
+ * end of that block to read it. If we are called late, after more blocks
+ * have finished, then those blocks all went into the other half. The half
+ * handed out still holds the first block to finish since the last call, and
+ * the next call hands out the other half, with the block being converted
+ * when this call was made.
+ *
+ * @returns The half of SampleBuffer::adc holding the finished block
+ */
+uint8_t adc_swap(void)
+{
+    uint8_t half = adc_half;
 
-    // Start conversion and wait until the DMA transfer completes
-    ADC12CTL0 |= ADC12SC;
+    DMA0DA = (uintptr_t)(adc_sb->adc[half]);
+    adc_half ^= 1;
+    return half;
 }
 
 /**
@@ -14,8 +14,27 @@
 #include "typedefs.h"
 #include "logger.h"
 
+/**
+ * The time taken by one conversion in ns. Each channel is sampled for 32
+ * ADC12CLK cycles and converted in 13 more, at 5MHz.
+ */
+#define ADC_CONV_NS ((32 + 13) * 200UL)
+
+/**
+ * The most conversion memories that are used, one for each channel of each set
+ * of samples in a block when every channel is enabled.
+ */
+#define ADC_MEMS (ADC_CHANNELS * ADC_BLOCK)
+
+#if ADC_MEMS > 16
+#error "ADC_CHANNELS * ADC_BLOCK must fit in the 16 ADC12 conversion memories"
+#endif
+
 void adc_init(volatile SampleBuffer *sb);
-void adc_convert(void);
+void adc_start(void);
+void adc_stop(void);
+uint8_t adc_set_channels(uint16_t mask);
+uint8_t adc_swap(void);
 
 #endif /* __ADC_H__ */
 
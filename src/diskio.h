@@ -47,5 +47,9 @@ DRESULT disk_ioctl (BYTE, BYTE, void*);
 #define GET_SECTOR_COUNT	1	/* Get media size (for only f_mkfs()) */
 #define GET_SECTOR_SIZE		2	/* Get sector size (for multiple sector size (_MAX_SS >= 1024)) */
 #define GET_BLOCK_SIZE		3	/* Get erase block size (for only f_mkfs()) */
+#define CTRL_ERASE_SECTOR	4	/* Force erased a block of sectors (for f_expand() and _USE_ERASE) */
+
+/* MMC/SDC specific command */
+#define MMC_GET_BUSY		10	/* Poll once whether the card is still programming (BYTE) */
 
 #endif
@@ -747,6 +747,90 @@ FRESULT move_window (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* FAT cache - Write back a FAT buffer                                   */
+/*-----------------------------------------------------------------------*/
+#if _FAT_CACHE && !_FS_READONLY
+static
+FRESULT flush_fat (
+	FATFS *fs,	/* File system object */
+	BYTE w		/* FAT buffer to write back if it is dirty */
+)
+{
+	DWORD sect;
+	BYTE nf;
+
+
+	if (fs->fcflag[w]) {
+		sect = fs->fcsect[w];
+		if (disk_write(fs->drv, fs->fcbuf[w], sect, 1) != RES_OK)
+			return FR_DISK_ERR;
+		fs->fcflag[w] = 0;
+		for (nf = fs->n_fats; nf > 1; nf--) {	/* Reflect the change to all FAT copies */
+			sect += fs->fsize;
+			disk_write(fs->drv, fs->fcbuf[w], sect, 1);
+		}
+	}
+
+	return FR_OK;
+}
+#endif
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT cache - Make a FAT sector appear in memory                        */
+/*-----------------------------------------------------------------------*/
+
+static
+BYTE* fat_window (	/* Pointer to the sector data, 0:Disk error */
+	FATFS *fs,		/* File system object */
+	DWORD sector,	/* FAT sector number */
+	BYTE dirty		/* 1:The caller is going to change the sector */
+)
+{
+#if _FAT_CACHE
+	BYTE w, v;
+
+
+	v = 0;
+	for (w = 0; w < _FAT_CACHE; w++) {
+		if (fs->fcsect[w] == sector) break;		/* Found in the cache */
+		if ((WORD)(fs->fcclock - fs->fcuse[w]) > (WORD)(fs->fcclock - fs->fcuse[v]))
+			v = w;								/* Least recently used so far */
+	}
+	if (w < _FAT_CACHE) {
+		fs->fc_hit++;
+	} else {								/* Replace the least recently used buffer */
+		fs->fc_miss++;
+		w = v;
+#if !_FS_READONLY
+		if (flush_fat(fs, w) != FR_OK) return 0;
+#endif
+		fs->fcsect[w] = 0;
+		if (disk_read(fs->drv, fs->fcbuf[w], sector, 1) != RES_OK)
+			return 0;
+		fs->fcsect[w] = sector;
+	}
+	fs->fcuse[w] = ++fs->fcclock;
+#if !_FS_READONLY
+	if (dirty) fs->fcflag[w] = 1;
+#endif
+	return fs->fcbuf[w];
+
+#else
+	if (move_window(fs, sector) != FR_OK) return 0;
+#if !_FS_READONLY
+	if (dirty) fs->wflag = 1;
+#endif
+	return fs->win;
+#endif
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Clean-up cached data                                                  */
 /*-----------------------------------------------------------------------*/
@@ -757,8 +841,15 @@ FRESULT sync (	/* FR_OK: successful, FR_DISK_ERR: failed */
 )
 {
 	FRESULT res;
+#if _FAT_CACHE
+	BYTE w;
 
 
+	for (w = 0; w < _FAT_CACHE; w++) {		/* Write back dirty FAT buffers */
+		if (flush_fat(fs, w) != FR_OK) return FR_DISK_ERR;
+	}
+#endif
+
 	res = move_window(fs, 0);
 	if (res == FR_OK) {
 		/* Update FSInfo sector if needed */
@@ -825,20 +916,20 @@ DWORD get_fat (	/* 0xFFFFFFFF:Disk error, 1:Internal error, Else:Cluster status
 	switch (fs->fs_type) {
 	case FS_FAT12 :
 		bc = (UINT)clst; bc += bc / 2;
-		if (move_window(fs, fs->fatbase + (bc / SS(fs)))) break;
-		wc = fs->win[bc % SS(fs)]; bc++;
-		if (move_window(fs, fs->fatbase + (bc / SS(fs)))) break;
-		wc |= fs->win[bc % SS(fs)] << 8;
+		if (!(p = fat_window(fs, fs->fatbase + (bc / SS(fs)), 0))) break;
+		wc = p[bc % SS(fs)]; bc++;
+		if (!(p = fat_window(fs, fs->fatbase + (bc / SS(fs)), 0))) break;
+		wc |= p[bc % SS(fs)] << 8;
 		return (clst & 1) ? (wc >> 4) : (wc & 0xFFF);
 
 	case FS_FAT16 :
-		if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 2)))) break;
-		p = &fs->win[clst * 2 % SS(fs)];
+		if (!(p = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 2)), 0))) break;
+		p += clst * 2 % SS(fs);
 		return LD_WORD(p);
 
 	case FS_FAT32 :
-		if (move_window(fs, fs->fatbase + (clst / (SS(fs) / 4)))) break;
-		p = &fs->win[clst * 4 % SS(fs)];
+		if (!(p = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 4)), 0))) break;
+		p += clst * 4 % SS(fs);
 		return LD_DWORD(p) & 0x0FFFFFFF;
 	}
 
@@ -868,40 +959,38 @@ FRESULT put_fat (
 		res = FR_INT_ERR;
 
 	} else {
+		res = FR_DISK_ERR;
 		switch (fs->fs_type) {
 		case FS_FAT12 :
 			bc = clst; bc += bc / 2;
-			res = move_window(fs, fs->fatbase + (bc / SS(fs)));
-			if (res != FR_OK) break;
-			p = &fs->win[bc % SS(fs)];
+			if (!(p = fat_window(fs, fs->fatbase + (bc / SS(fs)), 1))) break;
+			p += bc % SS(fs);
 			*p = (clst & 1) ? ((*p & 0x0F) | ((BYTE)val << 4)) : (BYTE)val;
 			bc++;
-			fs->wflag = 1;
-			res = move_window(fs, fs->fatbase + (bc / SS(fs)));
-			if (res != FR_OK) break;
-			p = &fs->win[bc % SS(fs)];
+			if (!(p = fat_window(fs, fs->fatbase + (bc / SS(fs)), 1))) break;
+			p += bc % SS(fs);
 			*p = (clst & 1) ? (BYTE)(val >> 4) : ((*p & 0xF0) | ((BYTE)(val >> 8) & 0x0F));
+			res = FR_OK;
 			break;
 
 		case FS_FAT16 :
-			res = move_window(fs, fs->fatbase + (clst / (SS(fs) / 2)));
-			if (res != FR_OK) break;
-			p = &fs->win[clst * 2 % SS(fs)];
+			if (!(p = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 2)), 1))) break;
+			p += clst * 2 % SS(fs);
 			ST_WORD(p, (WORD)val);
+			res = FR_OK;
 			break;
 
 		case FS_FAT32 :
-			res = move_window(fs, fs->fatbase + (clst / (SS(fs) / 4)));
-			if (res != FR_OK) break;
-			p = &fs->win[clst * 4 % SS(fs)];
+			if (!(p = fat_window(fs, fs->fatbase + (clst / (SS(fs) / 4)), 1))) break;
+			p += clst * 4 % SS(fs);
 			val |= LD_DWORD(p) & 0xF0000000;
 			ST_DWORD(p, val);
+			res = FR_OK;
 			break;
 
 		default :
 			res = FR_INT_ERR;
 		}
-		fs->wflag = 1;
 	}
 
 	return res;
@@ -1019,6 +1108,65 @@ DWORD create_chain (	/* 0:No free cluster, 1:Internal error, 0xFFFFFFFF:Disk err
 
 	return ncl;		/* Return new cluster number or error code */
 }
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* FAT handling - Count the free clusters                                */
+/*-----------------------------------------------------------------------*/
+/* This walks the whole FAT, so it is only done when the volume is mounted
+/  without a valid count. After that create_chain(), remove_chain() and
+/  f_expand() keep fs->free_clust up to date as they go. */
+
+static
+FRESULT count_free (
+	FATFS *fs		/* File system object */
+)
+{
+	FRESULT res;
+	DWORD n, clst, sect, stat;
+	UINT i;
+	BYTE fat, *p;
+
+
+	res = FR_OK;
+	fat = fs->fs_type;
+	n = 0;
+	if (fat == FS_FAT12) {
+		clst = 2;
+		do {
+			stat = get_fat(fs, clst);
+			if (stat == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+			if (stat == 1) { res = FR_INT_ERR; break; }
+			if (stat == 0) n++;
+		} while (++clst < fs->n_fatent);
+	} else {
+		clst = fs->n_fatent;
+		sect = fs->fatbase;
+		i = 0; p = 0;
+		do {
+			if (!i) {
+				p = fat_window(fs, sect++, 0);
+				if (!p) { res = FR_DISK_ERR; break; }
+				i = SS(fs);
+			}
+			if (fat == FS_FAT16) {
+				if (LD_WORD(p) == 0) n++;
+				p += 2; i -= 2;
+			} else {
+				if ((LD_DWORD(p) & 0x0FFFFFFF) == 0) n++;
+				p += 4; i -= 4;
+			}
+		} while (--clst);
+	}
+	if (res == FR_OK) {
+		fs->free_clust = n;
+		if (fat == FS_FAT32) fs->fsi_flag = 1;
+	}
+
+	return res;
+}
 #endif /* !_FS_READONLY */
 
 
@@ -2145,12 +2293,33 @@ FRESULT chk_mounted (	/* FR_OK(0): successful, !=0: any error occurred */
 	fs->id = ++Fsid;		/* File system mount ID */
 	fs->winsect = 0;		/* Invalidate sector cache */
 	fs->wflag = 0;
+#if _FAT_CACHE
+	for (b = 0; b < _FAT_CACHE; b++) {	/* Invalidate FAT cache */
+		fs->fcsect[b] = 0;
+		fs->fcflag[b] = 0;
+		fs->fcuse[b] = 0;
+	}
+	fs->fcclock = 0;
+	fs->fc_hit = fs->fc_miss = 0;
+#endif
 #if _FS_RPATH
 	fs->cdir = 0;			/* Current directory (root dir) */
 #endif
 #if _FS_SHARE				/* Clear file lock semaphores */
 	clear_lock(fs);
 #endif
+#if !_FS_READONLY
+	/* Count the free clusters now if fsinfo didn't give a valid count, so
+	   that finding the free space never needs a FAT scan later. A failure is
+	   not fatal, f_getfree() will try again. */
+	if (fs->free_clust > fs->n_fatent - 2) {
+		fs->free_clust = 0xFFFFFFFF;
+		count_free(fs);
+#if _FAT_CACHE
+		fs->fc_hit = fs->fc_miss = 0;	/* Count from normal use only */
+#endif
+	}
+#endif
 
 	return FR_OK;
 }
@@ -2348,6 +2517,9 @@ FRESULT f_open (
 		fp->fsize = LD_DWORD(dir+DIR_FileSize);	/* File size */
 		fp->fptr = 0;						/* File pointer */
 		fp->dsect = 0;
+#if !_FS_READONLY
+		fp->ecl = 0;						/* No preallocation */
+#endif
 #if _USE_FASTSEEK
 		fp->cltbl = 0;						/* Normal seek mode */
 #endif
@@ -2504,6 +2676,9 @@ FRESULT f_write (
 						clst = clmt_clust(fp, fp->fptr);	/* Get cluster# from the CLMT */
 					else
 #endif
+					if (fp->clust < fp->ecl)	/* Inside a contiguous preallocation, no need to follow the FAT */
+						clst = fp->clust + 1;
+					else
 						clst = create_chain(fp->fs, fp->clust);	/* Follow or stretch cluster chain on the FAT */
 				}
 				if (clst == 0) break;		/* Could not allocate a new cluster (disk full) */
@@ -2644,7 +2819,23 @@ FRESULT f_close (
 	LEAVE_FF(fs, res);
 
 #else
-	res = f_sync(fp);		/* Flush cached data */
+	res = FR_OK;
+	if (fp->ecl) {			/* Release the unused part of a contiguous preallocation */
+		res = validate(fp->fs, fp->id);
+		if (res == FR_OK && fp->fptr == fp->fsize) {
+			if (fp->fptr == 0) {				/* Nothing written, remove entire cluster chain */
+				res = remove_chain(fp->fs, fp->sclust);
+				fp->sclust = 0;
+			} else if (fp->clust < fp->ecl) {	/* Remove the clusters following the last written one */
+				res = put_fat(fp->fs, fp->clust, 0x0FFFFFFF);
+				if (res == FR_OK) res = remove_chain(fp->fs, fp->clust + 1);
+			}
+			fp->flag |= FA__WRITTEN;
+		}
+		if (res == FR_OK) fp->ecl = 0;
+	}
+	if (res == FR_OK)
+		res = f_sync(fp);	/* Flush cached data */
 #if _FS_SHARE
 	if (res == FR_OK) {		/* Decrement open counter */
 #if _FS_REENTRANT
@@ -3075,53 +3266,17 @@ FRESULT f_getfree (
 )
 {
 	FRESULT res;
-	DWORD n, clst, sect, stat;
-	UINT i;
-	BYTE fat, *p;
 
 
 	/* Get drive number */
 	res = chk_mounted(&path, fatfs, 0);
 	if (res == FR_OK) {
-		/* If free_clust is valid, return it without full cluster scan */
-		if ((*fatfs)->free_clust <= (*fatfs)->n_fatent - 2) {
+		/* The count is kept from mount time on, so this only scans the FAT if
+		   that failed */
+		if ((*fatfs)->free_clust > (*fatfs)->n_fatent - 2)
+			res = count_free(*fatfs);
+		if (res == FR_OK)
 			*nclst = (*fatfs)->free_clust;
-		} else {
-			/* Get number of free clusters */
-			fat = (*fatfs)->fs_type;
-			n = 0;
-			if (fat == FS_FAT12) {
-				clst = 2;
-				do {
-					stat = get_fat(*fatfs, clst);
-					if (stat == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
-					if (stat == 1) { res = FR_INT_ERR; break; }
-					if (stat == 0) n++;
-				} while (++clst < (*fatfs)->n_fatent);
-			} else {
-				clst = (*fatfs)->n_fatent;
-				sect = (*fatfs)->fatbase;
-				i = 0; p = 0;
-				do {
-					if (!i) {
-						res = move_window(*fatfs, sect++);
-						if (res != FR_OK) break;
-						p = (*fatfs)->win;
-						i = SS(*fatfs);
-					}
-					if (fat == FS_FAT16) {
-						if (LD_WORD(p) == 0) n++;
-						p += 2; i -= 2;
-					} else {
-						if ((LD_DWORD(p) & 0x0FFFFFFF) == 0) n++;
-						p += 4; i -= 4;
-					}
-				} while (--clst);
-			}
-			(*fatfs)->free_clust = n;
-			if (fat == FS_FAT32) (*fatfs)->fsi_flag = 1;
-			*nclst = n;
-		}
 	}
 	LEAVE_FF(*fatfs, res);
 }
@@ -3177,6 +3332,85 @@ FRESULT f_truncate (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Preallocate a Contiguous Cluster Run                                  */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_expand (
+	FIL *fp,		/* Pointer to the file object (empty and opened for writing) */
+	DWORD fsz,		/* Number of bytes to reserve */
+	BYTE opt		/* 0:Reserve only, 1:Also erase the reserved sectors */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD n, clst, stcl, scl, ncl, tcl, resion[2];
+
+
+	res = validate(fp->fs, fp->id);		/* Check validity of the object */
+	if (res != FR_OK) LEAVE_FF(fp->fs, res);
+	if (fp->flag & FA__ERROR)			/* Check abort flag */
+		LEAVE_FF(fp->fs, FR_INT_ERR);
+	if (!(fp->flag & FA_WRITE) || fp->sclust || !fsz)	/* Check access mode and that the file is empty */
+		LEAVE_FF(fp->fs, FR_DENIED);
+
+	fs = fp->fs;
+	n = (DWORD)fs->csize * SS(fs);		/* Cluster size (byte) */
+	tcl = fsz / n + ((fsz % n) ? 1 : 0);	/* Number of clusters required */
+	if (tcl > fs->n_fatent - 2 || (fs->free_clust <= fs->n_fatent - 2 && tcl > fs->free_clust))
+		LEAVE_FF(fs, FR_DENIED);
+
+	/* Search for a run of free clusters, starting from the last allocation */
+	stcl = fs->last_clust;
+	if (stcl < 2 || stcl >= fs->n_fatent) stcl = 2;
+	scl = clst = stcl; ncl = 0;
+	for (;;) {
+		n = get_fat(fs, clst);
+		if (n == 1) { res = FR_INT_ERR; break; }
+		if (n == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+		if (n == 0) {					/* Free cluster, extend the run */
+			if (++ncl == tcl) break;
+		} else {						/* Cluster in use, restart the run */
+			ncl = 0;
+		}
+		if (++clst >= fs->n_fatent) {	/* Wrap around, a run cannot span the end of the FAT */
+			clst = 2; ncl = 0;
+		}
+		if (!ncl) scl = clst;
+		if (clst == stcl) { res = FR_DENIED; break; }	/* No run long enough */
+	}
+
+	/* Link the run into a cluster chain */
+	if (res == FR_OK) {
+		for (clst = scl, n = tcl; n; clst++, n--) {
+			res = put_fat(fs, clst, (n == 1) ? 0x0FFFFFFF : clst + 1);
+			if (res != FR_OK) break;
+		}
+	}
+	if (res == FR_OK) {
+		fs->last_clust = scl + tcl - 1;	/* Update FSINFO */
+		if (fs->free_clust != 0xFFFFFFFF) {
+			fs->free_clust -= tcl;
+			fs->fsi_flag = 1;
+		}
+		fp->sclust = scl;				/* The file now owns the run */
+		fp->ecl = scl + tcl - 1;
+		fp->flag |= FA__WRITTEN;
+		if (opt) {						/* Erase the run, the media programs erased blocks faster */
+			resion[0] = clust2sect(fs, scl);					/* Start sector */
+			resion[1] = clust2sect(fs, fp->ecl) + fs->csize - 1;	/* End sector */
+			disk_ioctl(fs->drv, CTRL_ERASE_SECTOR, resion);		/* Only a hint, as for _USE_ERASE */
+		}
+	} else if (res != FR_DENIED) {
+		fp->flag |= FA__ERROR;
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Delete a File or Directory                                            */
 /*-----------------------------------------------------------------------*/
@@ -104,6 +104,15 @@ typedef struct {
 	DWORD	database;		/* Data start sector */
 	DWORD	winsect;		/* Current sector appearing in the win[] */
 	BYTE	win[_MAX_SS];	/* Disk access window for Directory, FAT (and Data on tiny cfg) */
+#if _FAT_CACHE
+	WORD	fcclock;		/* FAT cache access counter */
+	WORD	fcuse[_FAT_CACHE];	/* Access counter at the last use of each FAT buffer */
+	BYTE	fcflag[_FAT_CACHE];	/* FAT buffer dirty flags (1:must be written back) */
+	DWORD	fcsect[_FAT_CACHE];	/* Sector held in each FAT buffer (0:None) */
+	DWORD	fc_hit;			/* Number of FAT accesses found in the cache */
+	DWORD	fc_miss;		/* Number of FAT accesses that loaded a sector */
+	BYTE	fcbuf[_FAT_CACHE][_MAX_SS];	/* FAT sector buffers */
+#endif
 } FATFS;
 
 
@@ -123,6 +132,7 @@ typedef struct {
 #if !_FS_READONLY
 	DWORD	dir_sect;		/* Sector containing the directory entry */
 	BYTE*	dir_ptr;		/* Ponter to the directory entry in the window */
+	DWORD	ecl;			/* Last cluster of a contiguous preallocation (0:Not preallocated) */
 #endif
 #if _USE_FASTSEEK
 	DWORD*	cltbl;			/* Pointer to the cluster link map table (null on file open) */
@@ -212,6 +222,7 @@ FRESULT f_stat (const TCHAR*, FILINFO*);			/* Get file status */
 FRESULT f_write (FIL*, const void*, UINT, UINT*);	/* Write data to a file */
 FRESULT f_getfree (const TCHAR*, DWORD*, FATFS**);	/* Get number of free clusters on the drive */
 FRESULT f_truncate (FIL*);							/* Truncate file */
+FRESULT f_expand (FIL*, DWORD, BYTE);				/* Preallocate (and optionally erase) a contiguous cluster run to an empty file */
 FRESULT f_sync (FIL*);								/* Flush cached data of a writing file */
 FRESULT f_unlink (const TCHAR*);					/* Delete an existing file or directory */
 FRESULT	f_mkdir (const TCHAR*);						/* Create a new directory */
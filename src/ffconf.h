@@ -20,6 +20,20 @@
 /  data transfer. This reduces memory consumption 512 bytes each file object. */
 
 
+#ifndef _FAT_CACHE
+#define	_FAT_CACHE		1	/* 0:Disable or 1-n:Number of FAT sector buffers */
+#endif
+/* When _FAT_CACHE is set, FAT sectors are kept in a cache of their own with
+/  this many sector buffers, replaced least recently used first, instead of
+/  passing through the window. FAT lookups and updates then no longer evict
+/  directory and (on tiny cfg) file data sectors from the window, nor each
+/  other. Dirty buffers are written back to all FAT copies when they are
+/  replaced and on sync. Each buffer takes _MAX_SS bytes of memory. The hits
+/  and misses are counted in fc_hit and fc_miss of the file system object.
+/  It may be given on the command line instead, as the host tests in test/ do
+/  to build fatfs once for each cache size. */
+
+
 #define _FS_READONLY	0	/* 0:Read/Write or 1:Read only */
 /* Setting _FS_READONLY to 1 defines read only configuration. This removes
 /  writing functions, f_write, f_sync, f_unlink, f_mkdir, f_chmod, f_rename,
@@ -145,7 +159,10 @@
 
 #define	_USE_ERASE	0	/* 0:Disable or 1:Enable */
 /* To enable sector erase feature, set _USE_ERASE to 1. CTRL_ERASE_SECTOR command
-/  should be added to the disk_ioctl functio. */
+/  should be added to the disk_ioctl functio. This erases every cluster chain
+/  that is removed, including the unused part of an f_expand() preallocation
+/  when the file is closed. f_expand() can erase the run that it reserves
+/  whatever this is set to. */
 
 
 
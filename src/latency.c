@@ -0,0 +1,69 @@
+/**
+ * Gather the distribution of the time taken to write to the SD card, so that
+ * cards can be compared on how often they stall and for how long.
+ *
+ * Times are binned on a log scale, doubling from LAT_MIN, since what matters
+ * is not the typical write but the long tail of writes during which the card
+ * is busy with its own housekeeping.
+ *
+ * @file latency.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup latency
+ * @{
+ */
+
+#include <string.h>
+#include "latency.h"
+
+/**
+ * Clear a set of latency statistics.
+ * @param l A pointer to the statistics
+ */
+void lat_reset(LatencyStats *l)
+{
+    memset(l, 0, sizeof(*l));
+}
+
+/**
+ * Add the time taken by a write to a set of latency statistics. The sectors
+ * are binned by the average time per sector, but the write is checked
+ * against LAT_SLOW and the maximum by its whole time, since that is how long
+ * the ring buffer has to hold out for.
+ * @param l A pointer to the statistics
+ * @param us The time taken by the whole write in microseconds
+ * @param sectors The number of sectors written, taken to be 1 if 0
+ */
+void lat_add(LatencyStats *l, uint32_t us, uint16_t sectors)
+{
+    uint32_t per;
+    uint8_t i;
+
+    if(!sectors)
+        sectors = 1;
+    per = us / sectors;
+
+    for(i = 0; i < LAT_BINS - 1 && per >= (LAT_MIN << i); i++);
+    l->bins[i] += sectors;
+
+    l->writes++;
+    if(us >= LAT_SLOW)
+        l->slow++;
+    if(us > l->max)
+        l->max = us;
+}
+
+/**
+ * Find the upper bound of a bin of a latency histogram.
+ * @param i The index of the bin
+ * @returns The time per sector in microseconds below which writes fall into
+ * the bin, or 0 for the last bin which has no upper bound
+ */
+uint32_t lat_bound(uint8_t i)
+{
+    return i < LAT_BINS - 1 ? LAT_MIN << i : 0;
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,60 @@
+/**
+ * Write latency statistics header.
+ *
+ * @file latency.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup latency
+ * @{
+ */
+
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include "typedefs.h"
+
+/**
+ * The number of bins in a latency histogram, and the upper bound of the first
+ * bin in microseconds per sector. Each bin after that is twice as wide as the
+ * one before, and the last takes everything longer.
+ */
+#define LAT_BINS 8
+#define LAT_MIN 512UL
+
+/**
+ * The time in microseconds at or above which a write is counted as slow,
+ * however many sectors it wrote. A handful of these is normal for most cards, but a card that makes
+ * many will overflow the ring buffer at high logging rates.
+ */
+#define LAT_SLOW 10000UL
+
+/**
+ * @struct LatencyStats
+ * The distribution of the time taken by a series of writes.
+ * @var LatencyStats::bins
+ * The number of sectors written in each bin of time per sector. All of the
+ * sectors of a multiple sector write are taken to have cost the same.
+ * @var LatencyStats::writes
+ * The number of writes.
+ * @var LatencyStats::slow
+ * The number of writes that took LAT_SLOW or more in all.
+ * @var LatencyStats::max
+ * The longest time taken by any write, in microseconds.
+ */
+typedef struct LatencyStats
+{
+    uint32_t bins[LAT_BINS];
+    uint32_t writes;
+    uint32_t slow;
+    uint32_t max;
+} LatencyStats;
+
+void lat_reset(LatencyStats *l);
+void lat_add(LatencyStats *l, uint32_t us, uint16_t sectors);
+uint32_t lat_bound(uint8_t i);
+
+#endif /* __LATENCY_H__ */
+
+/**
+ * @}
+ */
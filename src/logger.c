@@ -21,41 +21,182 @@
 #include "logger.h"
 #include "adc.h"
 #include "ff.h"
+#include "diskio.h"
 #include "uart.h"
 #include "system.h"
 #include "typedefs.h"
 #include "mmc.h"
+#include "rice.h"
+#include "latency.h"
 
 /**
- * Quick facility to get the used value of a ring buffer
- * @param b A pointer to the buffer which we wish to query
+ * The longest period in SMCLK cycles that TA0 can count.
  */
-#define rb_getused_m(b) ((b->tail==b->head) ? 0:(b->head - b->tail + b->len) % b->len)
+#define TA0_PERIOD_MAX 65536UL
 
 /**
- * Quick facility to get the free value of a ring buffer
- * @param b A pointer to the buffer which we wish to query
+ * Quick facility to get the number of nibbles that an ADC channel's results
+ * take in a tagged record.
+ * @param i The channel number
  */
-#define rb_getfree_m(b) ((b->tail==b->head) ? b->len : (b->tail - b->head + b->len) % b->len)
+#define adc_nibbles_m(i) (log_width[i] > 12 ? 4 : 3)
 
 /**
- * Reset a ring buffer to its original empty state
- * @param b A pointer to the buffer which we wish to query
+ * The number of RECORD_TIME timestamps written each second at a logging
+ * frequency, under the LOG_STAMP setting.
+ * @param hz The logging frequency in Hz
  */
-#define rb_reset_m(b) do {b->tail = b->head = 0} while (0)
+#if LOG_STAMP == LOG_STAMP_RECORD
+#define stamp_hz_m(hz) ((hz) / ADC_BLOCK + ACCEL_DATA_HZ)
+#elif LOG_STAMP == LOG_STAMP_BLOCK
+#define stamp_hz_m(hz) ((hz) / ADC_BLOCK)
+#else
+#define stamp_hz_m(hz) 0
+#endif
 
 static volatile uint32_t time;
+static volatile uint8_t rate_change, channel_change, run_change;
+static const uint16_t rate_presets[] = LOG_FREQ_PRESETS;
+static const uint16_t channel_presets[] = LOG_ADC_PRESETS;
+static uint8_t log_div[LOG_CHANNELS];
+static uint8_t log_phase[ADC_CHANNELS];
+static const uint8_t adc_osr[ADC_CHANNELS] = ADC_OVERSAMPLE;
+static uint8_t adc_shift[ADC_CHANNELS];
+static uint16_t adc_sum[ADC_CHANNELS];
+static uint16_t adc_last[ADC_CHANNELS];
+static uint8_t log_width[LOG_CHANNELS];
 static volatile uint8_t logger_running, file_open;
 static char s[UART_BUF_LEN];
-static char ringbuf[SD_RINGBUF_LEN];
-static char writebuf[512];
+
+static uint8_t log_record(RingBuffer *rb, void *data, uint16_t n,
+        uint8_t count, uint32_t t);
+static uint8_t log_gap(RingBuffer *rb);
+static void log_lost(uint8_t kind, uint32_t n);
+static uint8_t pack_record(uint8_t *p, const uint16_t *adc,
+        volatile SampleBuffer *sb, uint16_t mask);
+static uint8_t pack_time(uint8_t *p, uint32_t us);
+static uint8_t record_len(const uint8_t *p);
+static uint16_t log_schedule(void);
+static void log_schedule_reset(void);
+static void log_decimate(uint16_t *adc, const volatile uint16_t *raw,
+        uint16_t mask);
+static void log_skip(uint32_t n);
+static void accel_ready(void);
+static void accel_done(void);
+static void s2_edge(void);
+static uint8_t log_pad(RingBuffer *rb);
+static void log_flush(RingBuffer *rb);
+static void seal_sectors(char *data, uint16_t n);
+static void hand_off(char *data, uint16_t n);
+static uint8_t sd_ready(void);
+static void report_latency(void);
+static void report_lat(const char *name, const LatencyStats *l, FIL *f);
+static void report_line(FIL *f);
+static void write_info(char *sector);
+#if LOG_COMPRESS
+static void compress_sectors(char *data, uint16_t n);
+static void zsect_flush(void);
+#endif
+#if LOG_CAPTURE
+static uint8_t capture_hit(uint16_t v);
+static uint8_t capture_set(uint8_t hit);
+static uint32_t capture_skip(uint32_t n);
+#endif
+
+/// The number of sample sets taken since the data file was opened.
+static uint32_t tick;
+
+/// The number of consecutive sample sets lost so far, the tick at which the
+/// first of them was taken and why they were lost: RECORD_GAP if the SD ring
+/// buffer was full or RECORD_LATE if they were read too late. This is written
+/// out as a gap marker with that tag as soon as there is room again.
+static uint32_t drop_count, drop_start;
+static uint8_t drop_kind;
+
+/// The total number of sample sets dropped since the file was opened because
+/// the SD ring buffer was full, and the number thrown away as late.
+static volatile uint32_t drop_total, late_total;
+
+/// Channel bitmap of the ADC channels that are converted and logged, and the
+/// number of them, which is the number of conversions in a tick.
+static uint16_t adc_enabled = LOG_ADC_ENABLE;
+static uint8_t adc_count;
+
+/// The logging frequency last asked for with logger_set_rate(), which is
+/// worked out again for the new conversion sequence when the channels change.
+static uint16_t log_hz = LOG_FREQ;
+
+/// The number of SMCLK cycles that the ADC takes to convert a block, and the
+/// time from clock_cycles() at which the block that DMA_ISR() is next
+/// interrupted for should have finished.
+static uint32_t adc_cycles, adc_due;
+
+/// When the accelerometer last signalled a new reading: the tick of the next
+/// sample set to be logged and the number of ADC conversions since the start
+/// of that tick, plus whether this was taken whilst the file was open.
+static uint32_t accel_tick;
+static uint8_t accel_edge, accel_stamped;
+
+#if LOG_STAMP == LOG_STAMP_RECORD
+/// The time from clock_us() at which the accelerometer last signalled a new
+/// reading.
+static uint32_t accel_us;
+#endif
+
+/// The number of accelerometer readings dropped since the file was opened.
+static volatile uint32_t accel_drops;
+
+#if LOG_CAPTURE
+/// The state of the burst capture, the number of sets still to be logged
+/// after the trigger, the tick of the set that met the trigger condition and
+/// the last sample of CAPTURE_CHANNEL, for the slope trigger.
+static volatile capture_state_t capture;
+static uint32_t capture_left, capture_tick;
+static uint16_t capture_prev;
+#endif
+
+/// The header of the sector currently being filled in the SD ring buffer, the
+/// number of bytes used in that sector and the sequence number of the next
+/// sector to be started.
+static SectorHeader *sect_hdr;
+static uint16_t sect_fill;
+static uint32_t sect_seq;
+
+#if LOG_COMPRESS
+/// The compressor and the sector that it is filling, plus the tick of the
+/// next record to be compressed, the sequence number of the sector being
+/// filled and the number of SMCLK cycles spent compressing since the file
+/// was opened.
+static RiceEncoder rice;
+static char zsect[SD_SECTOR_LEN];
+static uint32_t ztick, zseq, zcycles;
+#endif
+
+/// Running totals of the bytes written to the card and the time spent doing
+/// so, used to measure the sustained SD write throughput of each file.
+static uint32_t sd_bytes, sd_time;
+
+/// The time taken by each sd_write() of the current file, and whether the
+/// region that it was written to was erased first (see LOG_PREERASE).
+static LatencyStats sd_lat;
+static uint8_t sd_erased;
+
+/// The time in microseconds that the card has spent busy with sectors waiting
+/// to be written to it, the longest of those busy periods, when the current
+/// one started and whether the card is in one.
+static uint32_t sd_busy, sd_busy_max, sd_busy_start;
+static uint8_t sd_stalled;
+
+/// Whether S2 is being held down, and the system time at which it was pressed.
+static uint8_t s2_down;
+static uint32_t s2_time;
 
 /// A RingBuffer that we will use to buffer sets of samples that are to be
 /// moved to the SD card
 static RingBuffer sdbuf;
 
 /// A SampleBuffer to store a single set of readings before they are transferred
-/// into the SD transaction buffer.
+/// into the SD ring buffer.
 static volatile SampleBuffer sb;
 
 /// A FATFS filesystem object which we use to handle files and
@@ -65,23 +206,24 @@ FATFS FatFs;
 FIL fil;
 /// Stores the current size of the data file.
 DWORD fsz;
+/// The current logging frequency in Hz.
+uint16_t log_rate;
 
 /**
  * Set up the hardware for logging functionality, including the configuration
  * of required peripherals such as the ADC and Accelerometer.
  *
- * Timer A1 (TA1) is configured to interrupt at the log frequency (1kHz), the
- * interrupt service routine (ISR) is TIMER1_A0_ISR() also found in this file
- * (please see that function's documentation for details of what is done in the
- * ISR).
- *
- * @todo Calculate TAxCCR0 value based on F_CPU instead of hard-coding.
+ * Timer A0 (TA0) is configured to trigger the ADC at the default log
+ * frequency (LOG_FREQ) using logger_set_rate(). Each block of ADC results is
+ * moved by DMA, which then interrupts; the interrupt service routine (ISR) is
+ * DMA_ISR() also found in this file (please see that function's documentation
+ * for details of what is done in the ISR).
  */
 void logger_init(void)
 {
     // Initialise the ADC with the sample buffer `sb`
     adc_init(&sb);
-    Cma3000_init(&sb);
+    Cma3000_init(&sb, accel_done);
 
     // Enable LEDs and turn them off (P1.0, P8.1, P8.2)
     P1DIR |= _BV(0);
@@ -106,22 +248,17 @@ void logger_init(void)
     S1_PORT_IES &= ~S1_PIN;
     S1_PORT_IFG &= ~S1_PIN;
     S1_PORT_IE |= S1_PIN;
-    S2_PORT_IES &= ~S2_PIN;
+    // S2 starts out waiting for a press, see s2_edge()
+    S2_PORT_IES |= S2_PIN;
     S2_PORT_IFG &= ~S2_PIN;
     S2_PORT_IE |= S2_PIN;
 
-    // Set up 16 bit timer TIMER1 to interrupt at the log frequency
-    TA1CCR0 = 24999;
-
-    // Clock from SMCLK with no divider, use "up" mode, use interrupts
-    TA1CTL |= TASSEL_2 | TACLR;
-
-    // Enable interrupts on CCR0
-    TA1CCTL0 |= CCIE;
-
     // Enable interrupts (if they're not already)
     eint();
 
+    // Set up 16 bit timer TIMER0 to trigger the ADC at the log frequency
+    logger_set_rate(LOG_FREQ);
+
     // The logger should start in its OFF state
     Dogs102x6_clearRow(1);
     Dogs102x6_stringDraw(1, 0, "Logging: OFF", DOGS102x6_DRAW_NORMAL);
@@ -132,6 +269,151 @@ void logger_init(void)
 }
 
 
+/**
+ * Set the logging frequency. Timer A0 is clocked from SMCLK through the
+ * smallest divider that lets a 16 bit period reach the number of enabled ADC
+ * channels times the requested rate, since each edge of TA0.1 converts one
+ * channel. The rate actually achieved is recorded in each data file.
+ *
+ * The rate is rejected if it is outside LOG_FREQ_MIN to LOG_FREQ_MAX, if a
+ * tick is shorter than an ADC conversion sequence, or if the data rate
+ * (including the accelerometer records and timestamps) would be more than the
+ * SD card can sustain (see LOG_SD_RATE). The last check is skipped when
+ * capturing bursts (see LOG_CAPTURE), which are written out at leisure.
+ *
+ * The ADC conversion sequence is set up for the enabled channels (see
+ * logger_set_channels()) and the channel schedule (see ADC_OVERSAMPLE) is
+ * worked out again for the new rate, and the length of SD card write stall
+ * that the ring buffer can absorb is reported over the UART.
+ *
+ * @param hz The new logging frequency in Hz
+ * @returns 0 for success, non-0 if the rate was rejected or logging is
+ * running
+ */
+uint8_t logger_set_rate(uint16_t hz)
+{
+    // The TAxCTL input divider settings, indexed by log2 of their division
+    static const uint16_t timer_id[] = {ID_0, ID_1, ID_2, ID_3};
+    uint32_t period, best = 0;
+    uint16_t div, best_id = ID_0;
+    uint8_t id, ex, best_ex = 0, i, n = 0;
+
+    if(logger_running || hz < LOG_FREQ_MIN || hz > LOG_FREQ_MAX)
+        return 1;
+
+    // The ADC must finish within a tick
+    for(i = 0; i < ADC_CHANNELS; i++)
+        if(adc_enabled & (1U << i))
+            n++;
+    period = 1000000000UL / hz;
+    if(period < n * ADC_CONV_NS)
+        return 1;
+
+#if !LOG_CAPTURE
+    // And the card has to keep up with the sectors that we produce
+    if((uint32_t)hz * SD_SECTOR_LEN / SECTOR_RECORDS
+            + (uint32_t)ACCEL_DATA_HZ * RECORD_ACCEL_LEN
+            + (uint32_t)stamp_hz_m(hz) * RECORD_TIME_LEN > LOG_SD_RATE)
+        return 1;
+#endif
+
+    // The input divider (ID) is 1, 2, 4 or 8 and the expansion divider
+    // (TAIDEX) 1 to 8, take the smallest product that fits
+    for(id = 0; id < 4; id++)
+    {
+        for(ex = 1; ex <= 8; ex++)
+        {
+            div = (1 << id) * ex;
+            if(F_CPU / ((uint32_t)div * hz * n) <= TA0_PERIOD_MAX
+                    && (!best || div < best))
+            {
+                best = div;
+                best_id = timer_id[id];
+                best_ex = ex;
+            }
+        }
+    }
+    if(!best)
+        return 1;
+
+    period = F_CPU / (best * hz * n);
+    log_rate = F_CPU / (best * period * n);
+    log_hz = hz;
+    adc_count = adc_set_channels(adc_enabled);
+    adc_cycles = best * period * adc_count * ADC_BLOCK;
+
+    // Oversampled channels are logged once per decimated result, with two
+    // extra bits for every factor of 16
+    for(i = 0; i < ADC_CHANNELS; i++)
+    {
+        adc_shift[i] = adc_osr[i] >= 16 ? 2 : adc_osr[i] >= 4 ? 1 : 0;
+        log_width[i] = 12 + adc_shift[i];
+    }
+    for(i = 0; i < ACCEL_CHANNELS; i++)
+        log_width[ADC_CHANNELS + i] = 8;
+
+    // Log each oversampled channel once per result and the rest at every
+    // tick, unless they are disabled. The accelerometer isn't scheduled, it
+    // is logged as it arrives.
+    for(i = 0; i < ADC_CHANNELS; i++)
+        log_div[i] = adc_enabled & (1U << i) ? 1 << (2 * adc_shift[i]) : 0;
+    for(i = 0; i < ACCEL_CHANNELS; i++)
+        log_div[ADC_CHANNELS + i] = 0;
+
+    // Clock from SMCLK through the dividers, the timer is stopped until
+    // logging is enabled. TACLR resets the divider logic. TA0.1 rises at
+    // the start of each period to trigger a conversion.
+    TA0CTL = TASSEL_2 | best_id | TACLR;
+    TA0EX0 = best_ex - 1;
+    TA0CCR0 = period - 1;
+    TA0CCR1 = period / 2;
+    TA0CCTL1 = OUTMOD_7;
+
+    // Report how long the card may stall for before samples are dropped
+    sprintf(s, "Rate: %uHz, buffer %lums", log_rate, (unsigned long)(RB_LEN
+            / SD_SECTOR_LEN) * SECTOR_RECORDS * 1000 / log_rate);
+    uart_debug(s);
+    sprintf(s, "Stack: %u bytes never used", stack_unused());
+    uart_debug(s);
+
+    sprintf(s, "Rate: %uHz", log_rate);
+    Dogs102x6_clearRow(5);
+    Dogs102x6_stringDraw(5, 0, s, DOGS102x6_DRAW_NORMAL);
+    return 0;
+}
+
+/**
+ * Choose which ADC channels are converted and logged. The conversion
+ * sequence, the DMA block and the timer are set up again for just those
+ * channels at the current logging frequency (see logger_set_rate()), and
+ * each data file records which channels it holds. Channels that are left out
+ * cost neither conversion time nor space on the card.
+ *
+ * @param mask Channel bitmap of the ADC channels to log, within LOG_ADC_MASK
+ * @returns 0 for success, non-0 if the mask is empty, has bits outside
+ * LOG_ADC_MASK or leaves out CAPTURE_CHANNEL when LOG_CAPTURE is set, the
+ * current rate can't be kept with these channels, or logging is running
+ */
+uint8_t logger_set_channels(uint16_t mask)
+{
+    uint16_t old = adc_enabled;
+
+    if(logger_running || !mask || (mask & ~LOG_ADC_MASK))
+        return 1;
+#if LOG_CAPTURE
+    if(!(mask & (1U << CAPTURE_CHANNEL)))
+        return 1;
+#endif
+
+    adc_enabled = mask;
+    if(logger_set_rate(log_hz))
+    {
+        adc_enabled = old;
+        return 1;
+    }
+    return 0;
+}
+
 /**
  * Update the LCD with the current status of the logger, including buffer
  * usage, data file size and SD card utilisation.
@@ -140,29 +422,35 @@ void logger_init(void)
  * the SD card and LCD panel being on the same SPI bus and will cause slowdown
  * of SD transactions.
  *
- * @param buf A pointer to the RingBuffer which we are monitoring.
+ * @param rb A pointer to the RingBuffer which we are monitoring.
  */
-void update_lcd(RingBuffer *buf)
+void update_lcd(RingBuffer *rb)
 {
     FATFS *fs;
     fs = &FatFs;
-    DWORD fre_clust, fre_sect, tot_sect;
-
-    /* Get volume information and free clusters of drive 1 */
-    f_getfree("", &fre_clust, &fs);
+    DWORD fre_sect, tot_sect;
+    uint32_t dropped;
+    uint16_t gie;
 
-    /* Get total sectors and free sectors */
-    tot_sect = (fs->n_fatent - 2) * fs->csize;
-    fre_sect = fre_clust * fs->csize;
+    // fatfs counts the free clusters when the card is mounted and keeps the
+    // count up to date as clusters are allocated and freed, so we just read
+    // it rather than asking with f_getfree(). It is only invalid if the card
+    // isn't mounted or couldn't be counted.
+    if(fs->fs_type && fs->free_clust <= fs->n_fatent - 2)
+    {
+        /* Get total sectors and free sectors */
+        tot_sect = (fs->n_fatent - 2) * fs->csize;
+        fre_sect = fs->free_clust * fs->csize;
 
-    /* Print the free space (assuming 512 bytes/sector) */
-    sprintf(s, "%lu/%luMB (%lu%%)", (tot_sect-fre_sect)/2000, 
-            tot_sect/2000, (100 - (100*fre_sect)/tot_sect));
-    Dogs102x6_clearRow(4);
-    Dogs102x6_stringDraw(4, 0, s, DOGS102x6_DRAW_NORMAL);
+        /* Print the free space (assuming 512 bytes/sector) */
+        sprintf(s, "%lu/%luMB (%lu%%)", (tot_sect-fre_sect)/2000, 
+                tot_sect/2000, (100 - (100*fre_sect)/tot_sect));
+        Dogs102x6_clearRow(4);
+        Dogs102x6_stringDraw(4, 0, s, DOGS102x6_DRAW_NORMAL);
+    }
 
     // Show bytes in buffer
-    sprintf(s, "Buffer: %u%%", (100*rb_getused_m(buf))/buf->len);
+    sprintf(s, "Buffer: %u%%", (uint16_t)((100UL * rb_getused(rb)) / RB_LEN));
     Dogs102x6_clearRow(2);
     Dogs102x6_stringDraw(2, 0, s, DOGS102x6_DRAW_NORMAL);
 
@@ -172,34 +460,46 @@ void update_lcd(RingBuffer *buf)
     Dogs102x6_clearRow(3);
     Dogs102x6_stringDraw(3, 0, s, DOGS102x6_DRAW_NORMAL);
 
-    // Monitor buffer overflow
-    if(buf->overflow)
-        lcd_debug("Buffer overflow");
+    // Monitor buffer overflow, the count is updated by the ISR so take a copy
+    // with interrupts off since it can't be read in one go, leaving them as
+    // they were
+    if(rb->overflow)
+    {
+        gie = __read_status_register() & GIE;
+        __disable_interrupt();
+        dropped = drop_total;
+        __bis_SR_register(gie);
+        sprintf(s, "Dropped: %lu", (unsigned long)dropped);
+        lcd_debug(s);
+    }
 }
 
 /**
  * Set up the SD card and the FATFS filesystem handler before commencing the
  * logging service.
  *
- * The controls regularly moving blocks of data from the SD buffer to the card
- * using sd_write(), which is done when the SD buffer size has reached at least
- * the sector size such that we write as quickly as possible. It also calls for
- * LCD display updates (with update_lcd()) and handling opening/closing of the
- * data file when logging starts/stops.
+ * This controls regularly moving whole sectors of data from the SD ring buffer
+ * to the card using sd_write(). The data is handed to the card in place, as
+ * soon as a sector has been filled, such that we always write whole sectors
+ * and never copy the sample data again after the ISR has put it in the
+ * buffer. It also calls for LCD display updates (with update_lcd()) and
+ * handling opening/closing of the data file when logging starts/stops.
  *
- * @param sdbuf A pointer to the SD card buffer. This is a RingBuffer that we
+ * @param rb A pointer to the SD ring buffer. This is a RingBuffer that we
  * will use to buffer incoming samples before they are logged to the SD card,
  * such that we can write entire sectors at once.
  */
-void start_logger(RingBuffer* sdbuf)
+void start_logger(RingBuffer* rb)
 {   
     FRESULT fr;
+    char *data;
+    uint16_t n;
+    uint8_t rate_index = 0, channel_index = 0;
+    DWORD fre;
+    FATFS *fs;
 
     // Initialise the ring buffer for SD transfers
-    sdbuf->buffer = ringbuf;
-    sdbuf->head = sdbuf->tail = sdbuf->overflow = 0;
-    sdbuf->len = SD_RINGBUF_LEN;
-    sdbuf->mask = sdbuf->len - 1;
+    rb_reset(rb);
 
     // Wait for an SD card to be inserted
     while(!detectCard())
@@ -218,11 +518,33 @@ void start_logger(RingBuffer* sdbuf)
         fr = f_mount(0, &FatFs);
     }
 
+    // fatfs doesn't touch the card until it is first used, so get it to
+    // mount the volume now, which counts the free clusters if the card
+    // doesn't record how many there are. update_lcd() then reads the count.
+    fr = f_getfree("", &fre, &fs);
+    if(fr)
+    {
+        sprintf(s, "Free space fail: %d", fr);
+        uart_debug(s);
+    }
+
     // Now we can begin updating the LCD
-    update_lcd(sdbuf);
+    update_lcd(rb);
 
     while(1)
     {
+        // Start or stop logging on each press of S1. This is done here rather
+        // than in PORT1_ISR() since it draws on the LCD, which shares USCI_B1
+        // with the SD card and would break into a DMA frame.
+        if(run_change)
+        {
+            run_change = 0;
+            if(logger_running)
+                logger_disable();
+            else
+                logger_enable();
+        }
+
         // If we just started logging then open the file
         if(logger_running && !file_open)
         {
@@ -234,7 +556,52 @@ void start_logger(RingBuffer* sdbuf)
                 uart_debug(s);
                 fr = f_open(&fil, "data.log", FA_READ | FA_WRITE | FA_CREATE_ALWAYS);
             }
-            sdbuf->overflow = 0;
+
+            // Reserve a contiguous region for the file up front and commit
+            // the FAT straight away, so none of the allocation work lands in
+            // the middle of the data stream. If the card is too full or
+            // fragmented we can still log, we just lose the flat write cost.
+            // Erasing the region as well takes a moment but leaves the card
+            // less to do as we write into it.
+#if LOG_PREERASE == 2
+            sd_erased = !sd_erased;
+#else
+            sd_erased = LOG_PREERASE;
+#endif
+            if(sd_erased)
+                lcd_debug("Erasing");
+            fr = f_expand(&fil, LOG_PREALLOC_LEN, sd_erased);
+            if(fr == FR_OK)
+                fr = f_sync(&fil);
+            if(fr)
+            {
+                sprintf(s, "Prealloc fail: %d", fr);
+                uart_debug(s);
+            }
+
+            // The first sector describes the file. The ring buffer is empty
+            // and the ISR isn't using it yet so build the sector in there.
+            write_info(rb->buf);
+
+            rb_reset(rb);
+            log_schedule_reset();
+            tick = drop_count = drop_total = late_total = accel_drops = 0;
+            accel_stamped = 0;
+            sect_fill = 0;
+            sect_seq = 0;
+            sd_bytes = sd_time = 0;
+            sd_busy = sd_busy_max = 0;
+            sd_stalled = 0;
+            lat_reset(&sd_lat);
+            lat_reset(&WriteLat);
+#if LOG_COMPRESS
+            ztick = zseq = zcycles = 0;
+            zsect_flush();
+#endif
+#if LOG_CAPTURE
+            capture = STATE_CAPTURE_ARMED;
+            capture_prev = 0x0FFF;
+#endif
             lcd_debug("");
             file_open = 1;
         }
@@ -242,8 +609,20 @@ void start_logger(RingBuffer* sdbuf)
         // If we just stopped logging then close the file
         if(!logger_running && file_open)
         {
-            // Write any remaining data to the disk
-            sd_write(sdbuf, writebuf, &fil, rb_getused_m(sdbuf));
+#if LOG_CAPTURE
+            // Records kept whilst waiting for a trigger that never came
+            // aren't part of any burst, so throw them away
+            if(capture == STATE_CAPTURE_ARMED)
+            {
+                rb_reset(rb);
+                sect_fill = 0;
+                drop_count = 0;
+            }
+#endif
+
+            // Write any remaining data to the disk, the timer is stopped so
+            // the ISR won't touch the buffer whilst we do this
+            log_flush(rb);
             if(f_sync(&fil))
                 lcd_debug("sync fail");
 
@@ -257,49 +636,165 @@ void start_logger(RingBuffer* sdbuf)
                 _delay_ms(100);
             }
             file_open = 0;
+
+            if(drop_total || late_total || accel_drops)
+            {
+                sprintf(s, "Dropped: %lu/%lu, late %lu, accel %lu",
+                        (unsigned long)drop_total, (unsigned long)tick,
+                        (unsigned long)late_total, (unsigned long)accel_drops);
+                uart_debug(s);
+            }
+
+            // Report the sustained write throughput (bytes/ms is kB/s),
+            // counting the time that data waited for the card to be ready,
+            // and how long the card kept it waiting
+            if(sd_time + sd_busy / 1000)
+            {
+                sprintf(s, "SD: %lukB/s, busy %lums, longest %luus",
+                        (unsigned long)(sd_bytes / (sd_time + sd_busy / 1000)),
+                        (unsigned long)(sd_busy / 1000),
+                        (unsigned long)sd_busy_max);
+                uart_debug(s);
+            }
+#if LOG_COMPRESS
+            // And the compression ratio and cost
+            if(sect_seq)
+            {
+                sprintf(s, "Rice: %lu%%, %lu cyc/sect",
+                        (unsigned long)(100 * zseq / sect_seq),
+                        (unsigned long)(zcycles / sect_seq));
+                uart_debug(s);
+            }
+#endif
+
+            // And the distribution of the time that the card took to write
+            report_latency();
+#if _FAT_CACHE
+            // And how often fatfs found the FAT sector it wanted in its
+            // cache since the card was mounted, to size the cache by
+            sprintf(s, "FAT cache: %lu hit, %lu miss",
+                    (unsigned long)FatFs.fc_hit, (unsigned long)FatFs.fc_miss);
+            uart_debug(s);
+#endif
+
+            // And the stack's worst case so far, which RB_RAM_RESERVE must
+            // cover. At 0 the stack has reached the globals.
+            n = stack_unused();
+            sprintf(s, "Stack: %u bytes never used", n);
+            uart_debug(s);
+            if(!n)
+                lcd_debug("stack overflow");
         }
 
-        // Use the fast getused() ring buffer function since we care about
-        // speed. Write one sector to the SD card.
-        if((rb_getused_m(sdbuf) > 512) && file_open && logger_running)
-            sd_write(sdbuf, writebuf, &fil, 512);
+#if LOG_CAPTURE
+        // Once the sets after the trigger have all been logged the ISR stops
+        // logging, so write out the rest of the burst and wait for the next
+        if(file_open && logger_running && capture == STATE_CAPTURE_FLUSH)
+        {
+            log_flush(rb);
+            if(f_sync(&fil))
+                lcd_debug("sync fail");
+            sprintf(s, "Trigger: tick %lu", (unsigned long)capture_tick);
+            uart_debug(s);
+            capture = STATE_CAPTURE_ARMED;
+        }
+#endif
+
+        // Hand any filled sectors straight to the SD card, all of those
+        // available are written together in a single transaction. If the
+        // card is still busy programming the last write we leave them in the
+        // buffer and carry on, rather than stalling the loop until it is
+        // ready. Whilst waiting for a capture trigger the ISR keeps the
+        // buffer trimmed to the recent records instead.
+        if(file_open && logger_running
+#if LOG_CAPTURE
+                && capture != STATE_CAPTURE_ARMED
+#endif
+                )
+        {
+            data = rb_peek(rb, &n);
+            n &= ~(SD_SECTOR_LEN - 1);
+            if(n && sd_ready())
+            {
+                hand_off(data, n);
+                rb_release(rb, n);
+            }
+        }
+
+        // Step through the preset rates on each press of S2
+        if(rate_change)
+        {
+            rate_change = 0;
+            if(!logger_running)
+            {
+                rate_index = (rate_index + 1) % (sizeof(rate_presets)
+                        / sizeof(rate_presets[0]));
+                if(logger_set_rate(rate_presets[rate_index]))
+                {
+                    sprintf(s, "Rate %uHz rejected", rate_presets[rate_index]);
+                    lcd_debug(s);
+                }
+            }
+        }
+
+        // And through the preset ADC channels on each long press
+        if(channel_change)
+        {
+            channel_change = 0;
+            if(!logger_running)
+            {
+                channel_index = (channel_index + 1) % (sizeof(channel_presets)
+                        / sizeof(channel_presets[0]));
+                if(logger_set_channels(channel_presets[channel_index]))
+                    sprintf(s, "ADC %02x rejected",
+                            channel_presets[channel_index]);
+                else
+                    sprintf(s, "ADC %02x", channel_presets[channel_index]);
+                lcd_debug(s);
+            }
+        }
 
         // Update the LCD once every 200ms
         if((clock_time() % 200) == 0)
-            update_lcd(sdbuf);
+            update_lcd(rb);
     }
 }
 
 /**
- * Write n bytes from a ring buffer to an SD card controlled by fatfs.
+ * Write n bytes of sample data to an SD card controlled by fatfs.
  *
  * We turn on the red LED on the board during an SD write transaction such that
  * the user can monitor the frequency and duration of writes. This is
  * particularly helpful in watching for SD clock stretching which often causes
- * buffer overflow.
- *
- * @note n should always be at least one sector (typically 512 bytes), hence
- * the RingBuffer rb. Doing otherwise will work but will likely cause
- * significant slowdown. The calling function can use the rb_getused_m() macro
- * to determine when there is one sector's worth (or more) of data in the
- * buffer and then call sd_write().
- *
- * @param rb A pointer to the ring buffer from which we will read the required
- * data.
- * @param writebuf A short buffer where we can temporarily place a single
- * before before writing it to the card.
- * @param n The number of bytes to be written to the card.
+ * buffer overflow. The time spent in each write is also accumulated so that
+ * the sustained throughput of the card can be reported when the file is
+ * closed, and the time taken by each write is added to the latency
+ * statistics for the file (see report_latency()).
+ *
+ * @note n should always be a whole number of sectors (typically 512 bytes).
+ * Doing otherwise will work but forces fatfs to copy the data through its
+ * sector window and will likely cause significant slowdown.
+ *
  * @param fil A pointer to the file to which we want to write.
+ * @param data A pointer to the data to be written, typically one or more
+ * sectors from the RingBuffer.
+ * @param n The number of bytes to be written to the card.
  * @return FRESULT The fatfs result code for the write operation.
  */
-FRESULT sd_write(RingBuffer *rb, char *writebuf, FIL *fil, uint16_t n)
+FRESULT sd_write(FIL *fil, char *data, uint16_t n)
 {
     FRESULT fr;
     UINT bw;
+    clock_time_t t;
+    uint32_t us;
 
-    ringbuf_read(rb, writebuf, n);
     P1OUT |= _BV(0);
-    fr = f_write(fil, writebuf, n, &bw);
+    t = clock_time();
+    us = clock_us();
+    fr = f_write(fil, data, n, &bw);
+    lat_add(&sd_lat, clock_us() - us, n / SD_SECTOR_LEN);
+    sd_time += clock_time() - t;
+    sd_bytes += bw;
     
     if(fr)
     {
@@ -311,96 +806,844 @@ FRESULT sd_write(RingBuffer *rb, char *writebuf, FIL *fil, uint16_t n)
 }
 
 /**
- * Write n bytes to a RingBuffer.
+ * Check whether the SD card has finished programming the data last written
+ * to it, without waiting for it. A write while the card is busy would spin in
+ * the driver until it is ready, so the start_logger() loop only writes once
+ * this says so. The length of each busy period is measured from the first
+ * check that finds the card busy to the first that finds it ready, and
+ * accumulated so that it can be reported when the file is closed.
  *
- * This is done via a fast memcpy operation and as such, there is logic in this
- * function to transparently handle the copy even if we're wrapping over the
- * boundary of the ring buffer.
+ * @returns 1 if the card is ready to be written to, 0 if it is busy
+ */
+static uint8_t sd_ready(void)
+{
+    BYTE busy;
+    uint32_t t;
+
+    // If the card can't be asked then let the write report the failure
+    if(disk_ioctl(0, MMC_GET_BUSY, &busy) != RES_OK)
+        busy = 0;
+
+    if(busy)
+    {
+        if(!sd_stalled)
+        {
+            sd_stalled = 1;
+            sd_busy_start = clock_us();
+        }
+        return 0;
+    }
+
+    if(sd_stalled)
+    {
+        sd_stalled = 0;
+        t = clock_us() - sd_busy_start;
+        sd_busy += t;
+        if(t > sd_busy_max)
+            sd_busy_max = t;
+    }
+    return 1;
+}
+
+/**
+ * Report how long the writes to the data file that has just been closed took,
+ * both as seen by the logger (each f_write() of sample data) and by the card
+ * driver (each disk_write(), which includes fatfs' own writes to the FAT and
+ * directory). This goes over the UART and into latency.txt alongside the data
+ * file, which is rewritten each time, so that cards can be compared on how
+ * often they stall and for how long without a scope on the red LED.
+ */
+static void report_latency(void)
+{
+    LatencyStats disk;
+    FIL *f = &fil;
+
+    // Writing the report goes through disk_write() too, so take a copy of
+    // the driver's statistics first
+    disk = WriteLat;
+
+    // The data file is closed so we can reuse its file object
+    if(f_open(f, "latency.txt", FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+        f = NULL;
+
+    sprintf(s, "Latency, %serased (us/sect):", sd_erased ? "" : "not ");
+    report_line(f);
+    report_lat("f_write", &sd_lat, f);
+    report_lat("disk_write", &disk, f);
+
+    if(f && f_close(f) != FR_OK)
+        lcd_debug("latency fail");
+}
+
+/**
+ * Report one set of latency statistics, as its maximum, the number of writes
+ * that were slow (see LAT_SLOW) and the number of sectors in each bin that
+ * has any in it.
  *
- * @param buf A pointer to the ring buffer we want to write to
- * @param data A pointer to the data to be written
- * @param n The number of bytes to be written to the ring buffer
- * @returns 0 for success, non-0 for failure
+ * @param name What was timed
+ * @param l A pointer to the statistics
+ * @param f A pointer to the open latency file, or NULL to only use the UART
  */
-uint8_t ringbuf_write(RingBuffer *buf, char* data, uint16_t n)
+static void report_lat(const char *name, const LatencyStats *l, FIL *f)
 {
-    uint16_t rem;
+    uint8_t i;
 
-    // Check we're not writing more than the buffer can hold
-    if(n >= buf->len)
-        return 1;
+    sprintf(s, "%s: %lu writes, %lu slow", name,
+            (unsigned long)l->writes, (unsigned long)l->slow);
+    report_line(f);
+    sprintf(s, " longest write: %luus", (unsigned long)l->max);
+    report_line(f);
 
-    // Make sure there's enough free space in the buffer for our data
-    if(rb_getfree_m(buf) < n)
+    for(i = 0; i < LAT_BINS; i++)
     {
-        buf->overflow = 1;
-        return 1;
+        if(!l->bins[i])
+            continue;
+        if(lat_bound(i))
+            sprintf(s, " <%lu: %lu", (unsigned long)lat_bound(i),
+                    (unsigned long)l->bins[i]);
+        else
+            sprintf(s, " >=%lu: %lu", (unsigned long)lat_bound(i - 1),
+                    (unsigned long)l->bins[i]);
+        report_line(f);
+    }
+}
+
+/**
+ * Send the line in the UART string buffer over the UART, and write it to a
+ * file as well if one is given.
+ *
+ * @param f A pointer to an open file, or NULL
+ */
+static void report_line(FIL *f)
+{
+    UINT bw;
+
+    uart_debug(s);
+    if(f)
+    {
+        f_write(f, s, strlen(s), &bw);
+        f_write(f, "\r\n", 2, &bw);
     }
+}
+
+/**
+ * Write a record into a RingBuffer, framing it into sectors as we go.
+ *
+ * A SectorHeader is written in front of the first record of each sector. If
+ * the record won't fit in what is left of the current sector then the rest of
+ * that sector is zeroed and the record starts a new one, so that records never
+ * span sectors. All of this goes into the buffer in a single reservation, so
+ * either the whole record is written or nothing is. A timestamp is written
+ * together with the record that it stamps in the same way, as a run of two
+ * records.
+ *
+ * This is called by the logging ISR and the accelerometer ISR, which can't
+ * interrupt each other, or by the start_logger() loop once logging has been
+ * stopped, so that there is only ever one producer at a time.
+ *
+ * @param rb A pointer to the ring buffer we want to write to
+ * @param data A pointer to the record to be written
+ * @param n The size of the record in bytes
+ * @param count The number of records in data, normally 1
+ * @param t The tick of the first sample set in the record, or of the next one
+ * to be logged for an accelerometer record
+ * @returns 1 if the record was written, 0 if there is no room
+ */
+static uint8_t log_record(RingBuffer *rb, void *data, uint16_t n,
+        uint8_t count, uint32_t t)
+{
+    uint16_t pad = 0, hdr = 0;
+    char *p;
+
+    if(sect_fill && sect_fill + n > SD_SECTOR_LEN)
+        pad = SD_SECTOR_LEN - sect_fill;
+    if(!sect_fill || pad)
+        hdr = sizeof(SectorHeader);
+
+    p = rb_reserve(rb, pad + hdr + n);
+    if(!p)
+        return 0;
 
-    // We can do a single memcpy as long as we don't wrap around the buffer
-    if(buf->head + n < buf->len)
+    // Finish off the current sector
+    memset(p, 0, pad);
+    p += pad;
+
+    // Start a new one
+    if(hdr)
     {
-        // We won't wrap, we can quickly memcpy
-        memcpy(buf->buffer + buf->head, data, n);
-        buf->head = (buf->head + n) & buf->mask;
-    } else {
-        // We're going to wrap, copy in 2 blocks
-        // Copy the first (SD_BUF_LEN - buf->head) bytes
-        rem = buf->len - buf->head;
-        memcpy(buf->buffer + buf->head, data, rem);
-        buf->head = (buf->head + rem) & buf->mask;
-        // Copy the remaining bytes
-        memcpy(buf->buffer + buf->head, data + rem, n - rem);
-        buf->head = (buf->head + (n-rem)) & buf->mask;
+        sect_hdr = (SectorHeader *)p;
+        sect_hdr->magic = SECTOR_MAGIC;
+        sect_hdr->layout = LAYOUT_TAGGED;
+        sect_hdr->seq = sect_seq++;
+        sect_hdr->tick = t;
+        sect_hdr->count = 0;
+        sect_hdr->crc = 0;
+        sect_fill = hdr;
+        p += hdr;
     }
-    return 0;
+
+    memcpy(p, data, n);
+    sect_hdr->count += count;
+    sect_fill += n;
+    if(sect_fill == SD_SECTOR_LEN)
+        sect_fill = 0;
+
+    rb_commit(rb, pad + hdr + n);
+
+    // A sector started in the slack after the end of the buffer has just
+    // been moved round to the start
+    if((char *)sect_hdr >= rb->buf + RB_LEN)
+        sect_hdr = (SectorHeader *)((char *)sect_hdr - RB_LEN);
+    return 1;
+}
+
+/**
+ * Pack the channels of a set of samples that are in a channel bitmap into a
+ * tagged record (see RECORD_MAX_LEN for the layout).
+ *
+ * @param p A pointer to RECORD_MAX_LEN bytes to write the record into
+ * @param adc A pointer to the ADC results, after decimation
+ * @param sb A pointer to the sample buffer holding the accelerometer readings
+ * @param mask Channel bitmap of the channels to write
+ * @returns The length of the record in bytes
+ */
+static uint8_t pack_record(uint8_t *p, const uint16_t *adc,
+        volatile SampleBuffer *sb, uint16_t mask)
+{
+    uint8_t *start = p;
+    uint16_t v;
+    uint8_t i, k, nib = 0;
+
+    *p++ = mask;
+    *p++ = (mask >> 8) | (RECORD_SAMPLE << 4);
+
+    // ADC results a nibble at a time, least significant first
+    for(i = 0; i < ADC_CHANNELS; i++)
+    {
+        if(!(mask & (1U << i)))
+            continue;
+        v = adc[i];
+        for(k = adc_nibbles_m(i); k; k--, nib++, v >>= 4)
+        {
+            if(nib & 1)
+                p[nib >> 1] |= (v & 0x0F) << 4;
+            else
+                p[nib >> 1] = v & 0x0F;
+        }
+    }
+    p += (nib + 1) >> 1;
+
+    for(i = 0; i < ACCEL_CHANNELS; i++)
+        if(mask & (1U << (ADC_CHANNELS + i)))
+            *p++ = sb->accel[2 * i + 1];
+
+    return p - start;
 }
 
 /**
- * Read n bytes from a ring buffer.
+ * Write a RECORD_TIME timestamp record.
  *
- * This is done via a fast memcpy operation and as such, there is logic in this
- * function to transparently handle the copy even if we're wrapping over the
- * boundary of the ring buffer.
+ * @param p A pointer to RECORD_TIME_LEN bytes to write the record into
+ * @param us The timestamp in microseconds, from clock_us()
+ * @returns The length of the record in bytes
+ */
+static uint8_t pack_time(uint8_t *p, uint32_t us)
+{
+    p[0] = 0;
+    p[1] = RECORD_TIME << 4;
+    memcpy(p + 2, &us, sizeof(us));
+    return RECORD_TIME_LEN;
+}
+
+/**
+ * Find the length of a tagged record from its header.
  *
- * @param buf A pointer to the ring buffer we want to write to
- * @param read_buffer Copy data into this array
- * @param n The number of bytes to be read from the ring buffer
- * @returns 0 for success, non-0 for failure
+ * @param p A pointer to the record
+ * @returns The length of the record in bytes
  */
-uint8_t ringbuf_read(RingBuffer *buf, char* read_buffer, uint16_t n)
+static uint8_t record_len(const uint8_t *p)
 {
-    uint16_t rem;
+    uint16_t mask = p[0] | ((p[1] & 0x0F) << 8);
+    uint8_t i, nib = 0, accel = 0;
+
+    if((p[1] >> 4) == RECORD_GAP || (p[1] >> 4) == RECORD_LATE)
+        return RECORD_GAP_LEN;
+    if((p[1] >> 4) == RECORD_ACCEL)
+        return RECORD_ACCEL_LEN;
+    if((p[1] >> 4) == RECORD_TIME)
+        return RECORD_TIME_LEN;
+
+    for(i = 0; i < ADC_CHANNELS; i++)
+        if(mask & (1U << i))
+            nib += adc_nibbles_m(i);
+    for(i = 0; i < ACCEL_CHANNELS; i++)
+        if(mask & (1U << (ADC_CHANNELS + i)))
+            accel++;
 
-    // We can't read more data than the buffer holds!
-    if(n >= buf->len)
+    return 2 + (nib + 1) / 2 + accel;
+}
+
+/**
+ * Restart the channel schedule and the decimators at the start of a file.
+ * Each channel is first due at tick zero, except that oversampled channels are
+ * first due once they have a full set of samples to decimate.
+ */
+static void log_schedule_reset(void)
+{
+    uint8_t i;
+
+    for(i = 0; i < ADC_CHANNELS; i++)
+    {
+        log_phase[i] = adc_shift[i] ? log_div[i] - 1 : 0;
+        adc_sum[i] = adc_last[i] = 0;
+    }
+}
+
+/**
+ * Find the ADC results to log for one set of samples in the block. Channels
+ * which aren't oversampled are logged as they are. Oversampled channels are
+ * accumulated, and when they are due the sum is shifted down to give the
+ * decimated result.
+ *
+ * @param adc A pointer to ADC_CHANNELS results to fill in
+ * @param raw A pointer to the set of ADC samples in the sample buffer, which
+ * holds only the enabled channels
+ * @param mask Channel bitmap of the channels due at this tick
+ */
+static void log_decimate(uint16_t *adc, const volatile uint16_t *raw,
+        uint16_t mask)
+{
+    uint16_t v;
+    uint8_t i;
+
+    for(i = 0; i < ADC_CHANNELS; i++)
+    {
+        if(!(adc_enabled & (1U << i)))
+            continue;
+        v = adc_last[i] = *raw++;
+        if(adc_shift[i])
+        {
+            adc_sum[i] += v;
+            if(mask & (1U << i))
+            {
+                v = adc_sum[i] >> adc_shift[i];
+                adc_sum[i] = 0;
+            }
+        }
+        adc[i] = v;
+    }
+}
+
+/**
+ * Step the channel schedule and the decimators on over a run of ticks whose
+ * samples were lost. The oversampled channels are fed the last sample that
+ * we have in place of each missing one, so that the results either side of
+ * the run stay at the right scale.
+ *
+ * @param n The number of ticks to skip
+ */
+static void log_skip(uint32_t n)
+{
+    uint16_t since;
+    uint8_t i;
+
+    for(i = 0; i < ADC_CHANNELS; i++)
+    {
+        if(!log_div[i])
+            continue;
+        if(n > log_phase[i])
+        {
+            // Due at least once in the run, so the sum starts again after
+            // the last time
+            since = (n - log_phase[i] - 1) % log_div[i];
+            log_phase[i] = log_div[i] - 1 - since;
+            adc_sum[i] = since * adc_last[i];
+        } else {
+            log_phase[i] -= n;
+            adc_sum[i] += n * adc_last[i];
+        }
+    }
+}
+
+/**
+ * Step the channel schedule on by one tick. Channel i is due at each tick
+ * that is a multiple of its divisor, counting from the start of the file (or
+ * one less than a multiple if it is oversampled, see log_schedule_reset()).
+ *
+ * @returns Channel bitmap of the ADC channels due at this tick
+ */
+static uint16_t log_schedule(void)
+{
+    uint16_t mask = 0;
+    uint8_t i;
+
+    for(i = 0; i < ADC_CHANNELS; i++)
+    {
+        if(!log_div[i])
+            continue;
+        if(!log_phase[i])
+        {
+            mask |= 1U << i;
+            log_phase[i] = log_div[i];
+        }
+        log_phase[i]--;
+    }
+    return mask;
+}
+
+/**
+ * Note when the accelerometer signalled a new reading and start reading it,
+ * unless the last read is still in progress. The ADC12IFG flags of the
+ * conversions in the current block are set in order and cleared when DMA
+ * moves the block, so they tell us how far through the block we are. If
+ * the block has finished but DMA_ISR() hasn't logged it yet then we are that
+ * far into the next one.
+ */
+static void accel_ready(void)
+{
+    accel_state_t state = Cma3000_getState();
+    uint16_t ifg = ADC12IFG;
+    uint8_t edge = 0;
+
+    if(state != STATE_ACCEL_NONE && state != STATE_ACCEL_DONE)
+        return;
+
+    while(edge < adc_count * ADC_BLOCK && (ifg & (1U << edge)))
+        edge++;
+    if(DMA0CTL & DMAIFG)
+        edge += adc_count * ADC_BLOCK;
+
+    accel_tick = tick;
+    accel_edge = edge;
+    accel_stamped = file_open;
+#if LOG_STAMP == LOG_STAMP_RECORD
+    accel_us = clock_us();
+#endif
+    Cma3000_startRead();
+}
+
+/**
+ * Log the accelerometer reading that has just been read into the sample
+ * buffer as a RECORD_ACCEL record, timed from the tick of the next sample set
+ * to be logged. This is called from the DMA or accelerometer ISR when the
+ * read started by accel_ready() finishes. If there is no room then the
+ * reading is counted in accel_drops; readings aren't covered by gap markers.
+ * With LOG_STAMP_RECORD the record is preceded by the time of its data ready
+ * interrupt.
+ */
+static void accel_done(void)
+{
+    uint8_t rec[RECORD_TIME_LEN + RECORD_ACCEL_LEN];
+    uint8_t *p = rec, count = 1;
+    int16_t offset;
+    uint8_t i;
+
+    // Only log whilst the ISR is the producer, see log_record()
+    if(!accel_stamped || !file_open || !logger_running)
+        return;
+#if LOG_CAPTURE
+    if(capture == STATE_CAPTURE_FLUSH)
+        return;
+#endif
+    accel_stamped = 0;
+
+    // DMA_ISR() may have logged the tick since the reading was signalled
+    offset = accel_edge - (int16_t)(tick - accel_tick) * adc_count;
+
+#if LOG_STAMP == LOG_STAMP_RECORD
+    p += pack_time(p, accel_us);
+    count++;
+#endif
+    p[0] = (uint8_t)LOG_ACCEL_MASK;
+    p[1] = (LOG_ACCEL_MASK >> 8) | (RECORD_ACCEL << 4);
+    p[2] = (int8_t)offset;
+    for(i = 0; i < ACCEL_CHANNELS; i++)
+        p[3 + i] = sb.accel[2 * i + 1];
+    p += RECORD_ACCEL_LEN;
+
+    // A pending gap has to go first so that the tick is right
+    if((drop_count && !log_gap(&sdbuf))
+            || !log_record(&sdbuf, rec, p - rec, count, tick))
+        accel_drops++;
+}
+
+/**
+ * Count a run of sample sets from the current tick onwards as lost, adding
+ * them to the sets waiting to be marked by log_gap(). The sets waiting are
+ * all lost for the same reason, so if the reason changes then those are
+ * written out first. If there's no room to do so then they stay waiting with
+ * their own reason and the new sets just join them, since they are lost
+ * either way.
+ *
+ * @param kind RECORD_GAP if the SD ring buffer was full, or RECORD_LATE if
+ * the sets were read too late
+ * @param n The number of sets lost
+ */
+static void log_lost(uint8_t kind, uint32_t n)
+{
+    // Only start a run of the new kind once the sets waiting are marked
+    if(!drop_count || (drop_kind != kind && log_gap(&sdbuf)))
+    {
+        drop_start = tick;
+        drop_kind = kind;
+    }
+    drop_count += n;
+    if(kind == RECORD_GAP)
+        drop_total += n;
+    else
+        late_total += n;
+}
+
+/**
+ * Write a gap marker for the sample sets that have been lost into a
+ * RingBuffer, and reset the drop count if successful.
+ *
+ * @param rb A pointer to the ring buffer we want to write to
+ * @returns 1 if the record was written, 0 if there is still no room
+ */
+static uint8_t log_gap(RingBuffer *rb)
+{
+    uint8_t g[RECORD_GAP_LEN];
+
+    g[0] = 0;
+    g[1] = drop_kind << 4;
+    memcpy(g + 2, &drop_start, sizeof(drop_start));
+    memcpy(g + 6, &drop_count, sizeof(drop_count));
+    if(!log_record(rb, g, RECORD_GAP_LEN, 1, drop_start))
+        return 0;
+
+    drop_count = 0;
+    return 1;
+}
+
+/**
+ * Zero the rest of the sector currently being filled in a RingBuffer such
+ * that it can be written to the card. This must only be called once the
+ * logging ISR has been stopped.
+ *
+ * @param rb A pointer to the ring buffer we want to write to
+ * @returns 1 if the sector was completed (or there was no sector in
+ * progress), 0 if there is no room
+ */
+static uint8_t log_pad(RingBuffer *rb)
+{
+    uint16_t pad;
+    char *p;
+
+    if(!sect_fill)
         return 1;
 
-    // We can't read more bytes than the buffer currently contains
-    if(n > rb_getused_m(buf))
-        n = rb_getused_m(buf);
-
-    if(buf->tail + n < buf->len)
-    {
-        // We won't wrap, we can quickly memcpy
-        memcpy(read_buffer, buf->buffer + buf->tail, n);
-        buf->tail = (buf->tail + n) & buf->mask;
-    } else {
-        // We're going to wrap, copy in 2 blocks
-        // Copy the first (SD_BUF_LEN - buf->head) bytes
-        rem = buf->len - buf->tail;
-        memcpy(read_buffer, buf->buffer + buf->tail, rem);
-        buf->tail = (buf->tail + rem) & buf->mask;
-        // Copy the remaining bytes
-        memcpy(read_buffer + rem, buf->buffer + buf->tail, n - rem);
-        buf->tail = (buf->tail + (n-rem)) & buf->mask;
+    // This may be more than a single reservation can hold, so take it in
+    // pieces
+    while(sect_fill)
+    {
+        pad = SD_SECTOR_LEN - sect_fill;
+        if(pad > RB_RESERVE_MAX)
+            pad = RB_RESERVE_MAX;
+        p = rb_reserve(rb, pad);
+        if(!p)
+            return 0;
+        memset(p, 0, pad);
+        rb_commit(rb, pad);
+        sect_fill += pad;
+        if(sect_fill == SD_SECTOR_LEN)
+            sect_fill = 0;
     }
-    return 0;
+    return 1;
+}
+
+/**
+ * Write out everything in a RingBuffer to the card. If we were still dropping
+ * samples then the gap is closed off first, then the last sector is padded
+ * out so that the file is all whole sectors. This must only be called when
+ * the ISRs aren't logging into the buffer, since we are the producer too.
+ *
+ * @param rb A pointer to the ring buffer to write out
+ */
+static void log_flush(RingBuffer *rb)
+{
+    char *data;
+    uint16_t n;
+
+    while((drop_count && !log_gap(rb)) || !log_pad(rb))
+    {
+        data = rb_peek(rb, &n);
+        n &= ~(SD_SECTOR_LEN - 1);
+        hand_off(data, n);
+        rb_release(rb, n);
+    }
+    data = rb_peek(rb, &n);
+    while(n)
+    {
+        hand_off(data, n);
+        rb_release(rb, n);
+        data = rb_peek(rb, &n);
+    }
+#if LOG_COMPRESS
+    zsect_flush();
+#endif
+}
+
+/**
+ * Fill in the CRC of each of a run of complete sectors just before they are
+ * written to the card. The hardware CRC16 module is used, which gives the
+ * standard CRC-16-CCITT when fed through the bit reversed input register.
+ *
+ * @param data A pointer to the first sector
+ * @param n The number of bytes, a whole number of sectors
+ */
+static void seal_sectors(char *data, uint16_t n)
+{
+    SectorHeader *h;
+    uint16_t i;
+
+    for(; n >= SD_SECTOR_LEN; n -= SD_SECTOR_LEN, data += SD_SECTOR_LEN)
+    {
+        h = (SectorHeader *)data;
+        h->crc = 0;
+        CRCINIRES = 0xFFFF;
+        for(i = 0; i < SD_SECTOR_LEN; i++)
+            CRCDIRB_L = data[i];
+        h->crc = CRCINIRES;
+    }
+}
+
+/**
+ * Write the file information sector, which must be the first sector of the
+ * data file.
+ *
+ * @param sector A pointer to SD_SECTOR_LEN bytes of scratch space in which
+ * to build the sector
+ */
+static void write_info(char *sector)
+{
+    SectorHeader *h = (SectorHeader *)sector;
+    FileInfo *info = (FileInfo *)(sector + sizeof(SectorHeader));
+
+    memset(sector, 0, SD_SECTOR_LEN);
+    h->magic = SECTOR_MAGIC;
+    h->layout = LAYOUT_FILE;
+    info->version = FILE_VERSION;
+    info->rate = log_rate;
+    info->adc_channels = ADC_CHANNELS;
+    info->accel_channels = ACCEL_CHANNELS;
+    memcpy(info->divisor, log_div, sizeof(info->divisor));
+    memcpy(info->width, log_width, sizeof(info->width));
+#if LOG_CAPTURE
+    info->post = CAPTURE_POST;
+#endif
+
+    seal_sectors(sector, SD_SECTOR_LEN);
+    sd_write(&fil, sector, SD_SECTOR_LEN);
 }
 
 /**
- * Enable TA1 to begin logging by setting mode control to "up" mode,
- * counter counts to TAxCCR0.
+ * Hand a run of complete sectors from the SD ring buffer to the card, either
+ * directly or through the compressor if LOG_COMPRESS is set.
+ *
+ * @param data A pointer to the first sector
+ * @param n The number of bytes, a whole number of sectors
+ */
+static void hand_off(char *data, uint16_t n)
+{
+#if LOG_COMPRESS
+    compress_sectors(data, n);
+#else
+    seal_sectors(data, n);
+    sd_write(&fil, data, n);
+#endif
+}
+
+#if LOG_COMPRESS
+/**
+ * Unpack each record from a run of sectors of tagged records and feed it to
+ * the Rice coder, writing out each compressed sector as it fills up.
+ *
+ * @param data A pointer to the first sector
+ * @param n The number of bytes, a whole number of sectors
+ */
+static void compress_sectors(char *data, uint16_t n)
+{
+    SectorHeader *h;
+    uint8_t *p;
+    uint16_t v[RICE_CHANNELS];
+    uint32_t start, count, us, t;
+    uint16_t i, mask;
+    uint8_t *q, j, k, nib;
+
+    t = clock_cycles();
+    for(; n >= SD_SECTOR_LEN; n -= SD_SECTOR_LEN, data += SD_SECTOR_LEN)
+    {
+        h = (SectorHeader *)data;
+        p = (uint8_t *)data + sizeof(SectorHeader);
+
+        // The ticks between captured bursts aren't logged, so start a new
+        // sector from the tick that the next burst carries on from
+        if(h->tick != ztick)
+        {
+            ztick = h->tick;
+            zsect_flush();
+        }
+        for(i = 0; i < h->count; i++, p += record_len(p))
+        {
+            if((p[1] >> 4) == RECORD_GAP || (p[1] >> 4) == RECORD_LATE)
+            {
+                memcpy(&start, p + 2, sizeof(start));
+                memcpy(&count, p + 6, sizeof(count));
+                while(!rice_gap(&rice, start, count,
+                            (p[1] >> 4) == RECORD_LATE))
+                    zsect_flush();
+                ztick = start + count;
+                continue;
+            }
+            if((p[1] >> 4) == RECORD_ACCEL)
+            {
+                for(j = 0; j < ACCEL_CHANNELS; j++)
+                    v[ADC_CHANNELS + j] = p[3 + j];
+                while(!rice_accel(&rice, v, p[2]))
+                    zsect_flush();
+                continue;
+            }
+            if((p[1] >> 4) == RECORD_TIME)
+            {
+                memcpy(&us, p + 2, sizeof(us));
+                while(!rice_time(&rice, us))
+                    zsect_flush();
+                continue;
+            }
+
+            // Undo pack_record()
+            mask = p[0] | ((p[1] & 0x0F) << 8);
+            q = p + 2;
+            nib = 0;
+            for(j = 0; j < ADC_CHANNELS; j++)
+            {
+                if(!(mask & (1U << j)))
+                    continue;
+                v[j] = 0;
+                for(k = 0; k < adc_nibbles_m(j); k++, nib++)
+                    v[j] |= ((q[nib >> 1] >> ((nib & 1) * 4)) & 0x0F)
+                        << (4 * k);
+            }
+            q += (nib + 1) >> 1;
+            for(j = 0; j < ACCEL_CHANNELS; j++)
+                if(mask & (1U << (ADC_CHANNELS + j)))
+                    v[ADC_CHANNELS + j] = *q++;
+
+            while(!rice_sample(&rice, v, mask))
+                zsect_flush();
+            ztick++;
+        }
+    }
+    zcycles += clock_cycles() - t;
+}
+
+/**
+ * Write out the compressed sector (if it holds anything) and start the next
+ * one, whose first record will be at ztick.
+ */
+static void zsect_flush(void)
+{
+    SectorHeader *h = (SectorHeader *)zsect;
+
+    if(rice.count)
+    {
+        h->count = rice.count;
+        seal_sectors(zsect, SD_SECTOR_LEN);
+        sd_write(&fil, zsect, SD_SECTOR_LEN);
+        zseq++;
+    }
+
+    rice_start(&rice, zsect, sizeof(SectorHeader), log_width);
+    h->magic = SECTOR_MAGIC;
+    h->layout = LAYOUT_RICE;
+    h->seq = zseq;
+    h->tick = ztick;
+}
+#endif
+
+#if LOG_CAPTURE
+/**
+ * Check a sample of CAPTURE_CHANNEL against the capture trigger, which is
+ * met if the sample is at least CAPTURE_LEVEL or has risen by at least
+ * CAPTURE_SLOPE since the last one (whichever of them are non-zero). This is
+ * checked for every sample whatever the state of the capture, so that the
+ * slope is always taken from the sample before.
+ *
+ * @param v The raw ADC result
+ * @returns 1 if the trigger condition is met, 0 otherwise
+ */
+static uint8_t capture_hit(uint16_t v)
+{
+    uint8_t hit = 0;
+
+    if(CAPTURE_LEVEL && v >= CAPTURE_LEVEL)
+        hit = 1;
+    if(CAPTURE_SLOPE && (int16_t)(v - capture_prev) >= CAPTURE_SLOPE)
+        hit = 1;
+    capture_prev = v;
+    return hit;
+}
+
+/**
+ * Step the capture on by one set of samples and find whether the set is part
+ * of a burst. Whilst armed every set is logged, and the first one that meets
+ * the trigger condition starts the CAPTURE_POST sets after it. The set after
+ * those ends the burst, and no more are logged until the start_logger() loop
+ * has written the burst out and armed the capture again.
+ *
+ * @param hit Non-zero if the set meets the trigger condition
+ * @returns 1 if the set should be logged, 0 if it falls between bursts
+ */
+static uint8_t capture_set(uint8_t hit)
+{
+    if(capture == STATE_CAPTURE_FLUSH)
+        return 0;
+
+    if(capture == STATE_CAPTURE_POST)
+    {
+        if(!capture_left)
+        {
+            capture = STATE_CAPTURE_FLUSH;
+            return 0;
+        }
+        capture_left--;
+    } else if(hit) {
+        capture = STATE_CAPTURE_POST;
+        capture_left = CAPTURE_POST;
+        capture_tick = tick;
+    }
+    return 1;
+}
+
+/**
+ * Step the capture on over a run of sets that were lost, as capture_set().
+ * Lost sets can't meet the trigger condition.
+ *
+ * @param n The number of sets lost
+ * @returns The number of those sets that are part of a burst, which should
+ * be marked as lost
+ */
+static uint32_t capture_skip(uint32_t n)
+{
+    if(capture == STATE_CAPTURE_FLUSH)
+        return 0;
+
+    if(capture == STATE_CAPTURE_POST && n > capture_left)
+    {
+        n = capture_left;
+        capture = STATE_CAPTURE_FLUSH;
+    }
+    if(capture == STATE_CAPTURE_POST)
+        capture_left -= n;
+    return n;
+}
+#endif
+
+/**
+ * Enable TA0 to begin logging by setting mode control to "up" mode,
+ * counter counts to TAxCCR0, with the ADC ready to convert from the first
+ * channel.
  *
  * The flag variable logger_running is asserted such that the start_logger()
  * loop notices that logging has started as should open the data file if it has
@@ -411,18 +1654,24 @@ uint8_t ringbuf_read(RingBuffer *buf, char* read_buffer, uint16_t n)
 void logger_enable(void)
 {
     // Stop any timer activity
-    TA1CTL &= ~MC_3;
+    TA0CTL &= ~MC_3;
+    adc_start();
 
     Dogs102x6_clearRow(1);
     Dogs102x6_stringDraw(1, 0, "Logging: ON", DOGS102x6_DRAW_NORMAL);
     logger_running = 1;
 
-    // Start the timer
-    TA1CTL |= MC_1;
+    // Start the timer. The last conversion of each block is started by the
+    // edge at the end of every adc_count * ADC_BLOCK timer periods, and
+    // DMA_ISR() expects the block to be ready once that conversion has
+    // finished.
+    adc_due = clock_cycles() + adc_cycles
+        + ADC_CONV_NS * (F_CPU / 1000000UL) / 1000;
+    TA0CTL |= MC_1 | TACLR;
 }
 
 /**
- * Disable TA1 to halt logging by setting mode control to STOP.
+ * Disable TA0 to halt logging by setting mode control to STOP.
  *
  * The flag logger_running is deasserted so that the start_logger() loop
  * notices and cleanly flushes and closes the data file.  We also write to the
@@ -433,39 +1682,153 @@ void logger_enable(void)
 void logger_disable(void)
 {
     // Clear bits 4 and 5
-    TA1CTL &= ~MC_3;
+    TA0CTL &= ~MC_3;
+    adc_stop();
     logger_running = 0;
     Dogs102x6_clearRow(1);
     Dogs102x6_stringDraw(1, 0, "Logging: OFF", DOGS102x6_DRAW_NORMAL);
 }
 
 /**
- * Interrupt service routine for Timer A1 (TA1), where we should log one block
- * of data.
+ * Interrupt service routine for the DMA controller, where we should log one
+ * block of data. DMA channel 0 interrupts once DMA has moved ADC_BLOCK sets
+ * of ADC results into one half of the SampleBuffer sb (see adc_swap()).
+ *
+ * We do this by decimating any oversampled channels (see log_decimate()) and
+ * packing the channels of each set in the block that are due at its tick (see
+ * log_schedule()) into a tagged record and writing it into the
+ * SD RingBuffer with log_record(), which also frames the data into sectors.
+ * There is no processing of the data since it is too slow -- this is left to
+ * post-processing on a desktop machine. If there is no room then the set is
+ * counted as dropped, and once space frees up a gap marker is written ahead
+ * of the next set so that the time base of the log can be recovered. The ADC
+ * carries on converting the next block by itself. The accelerometer is read
+ * and logged separately, on its data ready interrupt (see PORT2_ISR()).
+ *
+ * Unless LOG_STAMP is LOG_STAMP_NONE, the time at which we started on the
+ * block is written ahead of the first set in it that is logged.
+ *
+ * Blocks finish at fixed times, so we can tell from the system clock how late
+ * we are. If we were held off until after further blocks had finished then
+ * their interrupts have been merged into this one and their results written
+ * over, so their sets are marked as late (RECORD_LATE) to keep the time base
+ * right. The sets of this block are copied out of sb first and then only
+ * logged if DMA can't have started writing over them whilst we did so;
+ * otherwise they are marked as late too.
  *
- * We do this by copying the current SampleBuffer into the RingBuffer used for
- * SD transactions. There is no processing of the data since it is too slow --
- * this is left to post-processing on a desktop machine. We then trigger the
- * next conversion runs for the ADC and accelerometer such that next time we
- * enter this ISR, new data will be in the SampleBuffer sb.
+ * With LOG_CAPTURE each sample of CAPTURE_CHANNEL is checked against the
+ * trigger as well, and sets are only logged whilst a burst is being captured
+ * (see capture_set()). Whilst waiting for the trigger we also throw away the
+ * oldest sectors in the SD ring buffer, keeping the last CAPTURE_PRE_SECTORS.
+ *
+ * DMA channel 2 also interrupts at the end of each accelerometer read that
+ * is done by DMA, which is passed on to the accelerometer module.
  */
-interrupt(TIMER1_A0_VECTOR) TIMER1_A0_ISR(void)
+interrupt(DMA_VECTOR) DMA_ISR(void)
 {
-    // Write the contents of the sample buffer (sb) to the SD buffer
+    uint8_t rec[RECORD_TIME_LEN + RECORD_MAX_LEN];
+    uint16_t adc[ADC_BLOCK][ADC_CHANNELS];
+    uint16_t mask[ADC_BLOCK], iv;
+    uint8_t i, n, half, late, stamp = 0;
+    uint32_t us = 0, now, missed = 0, lost;
+#if LOG_CAPTURE
+    uint16_t hit = 0;
+#endif
+
+    iv = DMAIV;
+    if(iv == DMAIV_DMA2IFG)
+        Cma3000_dmaDone();
+    if(iv != DMAIV_DMA0IFG)
+        return;
+
+#if LOG_STAMP != LOG_STAMP_NONE
+    us = clock_us();
+    stamp = 1;
+#endif
+
+    // Take the half of sb that the block went into and see whether any more
+    // blocks had finished before we did so. Their interrupts are merged into
+    // this one and the next interrupt will be for the block after them, since
+    // they all went into the other half.
+    now = clock_cycles();
+    half = adc_swap();
+    if((int32_t)(now - adc_due) >= (int32_t)adc_cycles)
+    {
+        missed = (now - adc_due) / adc_cycles;
+        DMA0CTL &= ~DMAIFG;
+    }
+    adc_due += (missed + 1) * adc_cycles;
+
     if(file_open)
     {
-        ringbuf_write(&sdbuf, (char *)&sb, sizeof(SampleBuffer));
+        // Copy the block out of sb, then check that the block which will be
+        // written into this half can't have finished whilst we did so
+        for(i = 0; i < ADC_BLOCK; i++)
+        {
+            mask[i] = log_schedule();
+            log_decimate(adc[i], sb.adc[half] + i * adc_count, mask[i]);
+#if LOG_CAPTURE
+            if(capture_hit(adc_last[CAPTURE_CHANNEL]))
+                hit |= 1U << i;
+#endif
+        }
+        late = (int32_t)(clock_cycles() - adc_due) >= (int32_t)adc_cycles;
+
+        // Write each set to the SD ring buffer, closing off any gap in front
+        // of it first
+        for(i = 0; i < ADC_BLOCK; i++, tick++)
+        {
+#if LOG_CAPTURE
+            if(!capture_set(hit & (1U << i)))
+                continue;
+#endif
+            if(late)
+            {
+                log_lost(RECORD_LATE, 1);
+                continue;
+            }
+            n = stamp ? pack_time(rec, us) : 0;
+            n += pack_record(rec + n, adc[i], &sb, mask[i]);
+            if((drop_count && !log_gap(&sdbuf))
+                    || !log_record(&sdbuf, rec, n, 1 + stamp, tick))
+                log_lost(RECORD_GAP, 1);
+            else
+                stamp = 0;
+        }
+
+        // Then account for the blocks that were written over
+        if(missed)
+        {
+            lost = missed * ADC_BLOCK;
+            log_skip(lost);
+#if LOG_CAPTURE
+            lost = capture_skip(lost);
+#endif
+            if(lost)
+                log_lost(RECORD_LATE, lost);
+            tick += missed * ADC_BLOCK;
+        }
+
+#if LOG_CAPTURE
+        // The start_logger() loop leaves the buffer alone until we trigger,
+        // so we are the consumer and can release the oldest sectors. The
+        // sector being filled is never one of them.
+        if(capture == STATE_CAPTURE_ARMED)
+            while(rb_getused(&sdbuf) > CAPTURE_PRE_SECTORS * SD_SECTOR_LEN)
+                rb_release(&sdbuf, SD_SECTOR_LEN);
+#endif
     }
 
-    // Trigger the next conversion
-    adc_convert();
-    Cma3000_readAccelFSM();
+    // If the edge of a data ready was missed then INT stays high and there
+    // won't be another, so read it now to get things going again
+    if((ACCEL_INT_IN & ACCEL_INT) && !(ACCEL_INT_IFG & ACCEL_INT))
+        accel_ready();
 }
 
 /**
  * Interrupt vector for button S1 which is used for enabled and disabling
- * logging. We should debounce the button press using
- * the system ticks timer, and then enable or disable logging as required.
+ * logging. We should debounce the button press using the system ticks timer,
+ * and then leave the start_logger() loop to enable or disable logging.
  */
 interrupt(PORT1_VECTOR) PORT1_ISR(void)
 {
@@ -473,22 +1836,75 @@ interrupt(PORT1_VECTOR) PORT1_ISR(void)
     if((P1IV & P1IV_P1IFG7) && (clock_time() - time) > 250)
     {
         time = clock_time();
-        if(logger_running)
-            logger_disable();
-        else
-            logger_enable();
+        run_change = 1;
     }
 
 }
 
 /**
- * Interrupt vector for button S2
+ * Handle an edge on button S2. S2 interrupts on both edges so that the press
+ * can be timed: the edge to wait for next is chosen from the level that the
+ * pin has settled at, and is checked again after the flag is cleared so that
+ * an edge can't slip by in between. A release that comes within 50ms of the
+ * press is bounce and is ignored, a press shorter than S2_HOLD_MS asks for the
+ * next preset rate and a longer one for the next preset channels.
+ */
+static void s2_edge(void)
+{
+    uint8_t up;
+
+    do {
+        up = S2_PORT_IN & S2_PIN;
+        if(up)
+            S2_PORT_IES |= S2_PIN;
+        else
+            S2_PORT_IES &= ~S2_PIN;
+        // Changing the edge can set the flag again
+        S2_PORT_IFG &= ~S2_PIN;
+    } while(up != (S2_PORT_IN & S2_PIN));
+
+    if(!up)
+    {
+        if(!s2_down)
+        {
+            s2_down = 1;
+            s2_time = clock_time();
+        }
+    }
+    else if(s2_down)
+    {
+        s2_down = 0;
+        if((clock_time() - s2_time) >= S2_HOLD_MS)
+            channel_change = 1;
+        else if((clock_time() - s2_time) > 50)
+            rate_change = 1;
+    }
+}
+
+/**
+ * Interrupt vector for port 2, which is shared by button S2 and the
+ * accelerometer's data ready line (ACCEL_INT).
+ *
+ * S2 is used to step through the preset logging frequencies, or the preset
+ * ADC channels if it is held down (see s2_edge()). The change is left to the
+ * start_logger() loop, which only acts on it while logging is stopped. A data
+ * ready edge starts reading the new accelerometer values (see accel_ready()).
+ *
+ * Reading P2IV clears only the flag that it reports, so if both are pending
+ * we are straight back in here for the other one.
  */
 interrupt(PORT2_VECTOR) PORT2_ISR(void)
 {
-    if(P2IV & P2IV_P2IFG2)
+    switch(P2IV)
     {
-        ;
+        case P2IV_P2IFG2:
+            s2_edge();
+            break;
+        case P2IV_P2IFG5:
+            accel_ready();
+            break;
+        default:
+            break;
     }
 }
 
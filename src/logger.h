@@ -17,6 +17,7 @@
 #include <legacymsp430.h>
 #include "typedefs.h"
 #include "ff.h"
+#include "ringbuf.h"
 
 #define S1_PORT_OUT P1OUT
 #define S1_PORT_REN P1REN
@@ -25,6 +26,7 @@
 #define S1_PORT_IFG P1IFG
 #define S1_PIN _BV(7)
 
+#define S2_PORT_IN P2IN
 #define S2_PORT_OUT P2OUT
 #define S2_PORT_REN P2REN
 #define S2_PORT_IES P2IES
@@ -33,74 +35,496 @@
 #define S2_PIN _BV(2)
 
 /**
- * Ring buffer length for the SD card, should be a multiple of 2 of the
- * sector size (512 bytes)
+ * The size of one SD card sector in bytes. Sample data is handed to the card
+ * in whole sectors.
  */
-#define SD_RINGBUF_LEN 2048
+#define SD_SECTOR_LEN 512
+
+#if (RB_LEN % SD_SECTOR_LEN) != 0
+#error "RB_LEN must be a whole number of SD sectors"
+#endif
 
 /**
- * The ring buffer mask value. This is automatically calculated.
+ * The default logging frequency in Hz, which is the rate at which sets of
+ * samples are taken and written to the card. It may be changed with
+ * logger_set_rate() whilst logging is stopped.
  */
-#define SD_RINGBUF_MASK (SD_RINGBUF_LEN - 1)
+#define LOG_FREQ 1000
 
 /**
- * @struct RingBuffer
- * A ring buffer which can be attached to given (preallocated) memory area.
- * @var RingBuffer::buffer
- * A pointer to the start of the character buffer to be used by this ring 
- * buffer.
- * @var RingBuffer::head
- * A pointer to the head of the ring buffer (the next free byte available
- * for writing).
- * @var RingBuffer::tail
- * A pointer to the tail of the ring buffer (the next unread byte)
- * @var RingBuffer::len
- * The length of the ring buffer
- * @var RingBuffer::mask
- * This value is a ring buffer intrinsic and is automatically generated.
- * @var RingBuffer::overflow
- * A flag that will be set non-zero if a buffer overflow occurs (the head
- * tries to "overtake" the tail.
+ * The lowest logging frequency accepted by logger_set_rate(), in Hz. TA0 can
+ * only be divided down so far from SMCLK.
  */
-typedef struct RingBuffer
-{
-    char* buffer;
-    uint16_t head, tail, len, mask;
-    uint8_t overflow;
-} RingBuffer;
+#define LOG_FREQ_MIN 10
+
+/**
+ * The highest logging frequency accepted by logger_set_rate(), in Hz. Rates
+ * below this are still rejected if the ADC or SD card can't keep up.
+ */
+#define LOG_FREQ_MAX 10000
+
+/**
+ * The write rate in bytes/s that the SD card can be relied on to sustain,
+ * before compression. Use the "SD: kB/s" figure reported over the UART when a
+ * file is closed as a guide.
+ */
+#define LOG_SD_RATE 150000UL
+
+/**
+ * The logging frequencies that button S2 steps through whilst logging is
+ * stopped.
+ */
+#define LOG_FREQ_PRESETS {10, 100, 1000, 5000, 10000}
+
+/**
+ * The time in milliseconds that S2 has to be held down for to step through
+ * LOG_ADC_PRESETS instead of LOG_FREQ_PRESETS.
+ */
+#define S2_HOLD_MS 1000
+
+/**
+ * The number of bytes reserved for the data file as a single contiguous run
+ * of clusters when logging starts. Whilst we are inside this region fatfs
+ * never has to touch the FAT, so every sector costs the same to write. The
+ * unused part is released again when the file is closed. At 1kHz, with at
+ * least 26 records to a sector, the default of 64MB gives nearly an hour of
+ * logging, after which the file continues to grow as normal.
+ */
+#define LOG_PREALLOC_LEN (64UL * 1024 * 1024)
+
+/**
+ * Whether to erase the region reserved for each data file (see
+ * LOG_PREALLOC_LEN) before logging into it, as cards program erased blocks
+ * faster. Set to 2 to erase before every other file only, so that the write
+ * latencies reported over the UART when each file is closed can be compared
+ * with and without.
+ */
+#define LOG_PREERASE 1
 
 /**
- * The number of ADC channels that we will sample from. It is vital that this
+ * The number of ADC channels that we can sample from. It is vital that this
  * is correctly set such that the DMA system will work properly.
  */
 #define ADC_CHANNELS 7
 
+/**
+ * The number of sets of ADC samples that are collected by DMA before the CPU
+ * is interrupted to log them, so the CPU is woken once for every block.
+ * Up to ADC_CHANNELS conversion memories are needed for each set, out of the
+ * 16 in the ADC12.
+ */
+#define ADC_BLOCK 2
+
 /**
  * The number of accelerometer channels (typically 3) to be sampled from. This
  * must be set correctly such that the DMA transfer system will work correctly.
  */
 #define ACCEL_CHANNELS 3
 
+/**
+ * The number of channels in each set of samples, ADC channels first and then
+ * the accelerometer channels.
+ */
+#define LOG_CHANNELS (ADC_CHANNELS + ACCEL_CHANNELS)
+
+/**
+ * Channel bitmap of the ADC channels.
+ */
+#define LOG_ADC_MASK ((1U << ADC_CHANNELS) - 1)
+
+/**
+ * Channel bitmap of the accelerometer channels.
+ */
+#define LOG_ACCEL_MASK (((1U << ACCEL_CHANNELS) - 1) << ADC_CHANNELS)
+
+/**
+ * The oversampling ratio of each ADC channel, in channel order: 1, 4 or 16.
+ * Channels that aren't oversampled are logged at every tick. An oversampled
+ * channel is logged once every that many ticks, and the value logged is the
+ * sum of the samples taken since it was last logged shifted right by one bit
+ * per factor of 4. This gives 13 bits of resolution at a ratio of 4 and 14
+ * bits at 16, and averages out noise, for no more space on the card than a
+ * single sample. Channel 6 is the potentiometer.
+ *
+ * The accelerometer channels aren't on the schedule at all. Each new reading
+ * is logged as it arrives, in its own RECORD_ACCEL record.
+ */
+#define ADC_OVERSAMPLE {1, 1, 1, 1, 1, 1, 16}
+
+/**
+ * Channel bitmap of the ADC channels that are converted and logged from
+ * startup. It may be changed with logger_set_channels() whilst logging is
+ * stopped, which a long press of S2 does (see LOG_ADC_PRESETS). Channels that
+ * are left out aren't converted at all, so the rest are converted closer
+ * together and the highest logging frequency goes up, and they take no space
+ * in the records.
+ */
+#define LOG_ADC_ENABLE LOG_ADC_MASK
+
+/**
+ * The ADC channel bitmaps that a long press of S2 (see S2_HOLD_MS) steps
+ * through whilst logging is stopped: every channel, every channel but the
+ * potentiometer, and channel 0 on its own for the highest logging frequency.
+ */
+#define LOG_ADC_PRESETS {LOG_ADC_MASK, LOG_ADC_MASK & ~_BV(6), _BV(0)}
+
 /**
  * @struct SampleBuffer
  * @brief A structure to contain one 'set' of samples from the vehicle.
  * @var SampleBuffer::adc
- * Storage for the ADC channels
+ * Storage for the ADC channels of each set in a block, filled by DMA. There
+ * are two halves which successive blocks go into in turn (see adc_swap()).
+ * Only the enabled channels are stored, in channel order, so each set takes
+ * as many words as there are channels enabled (see adc_set_channels())
  * @var SampleBuffer::accel
- * Storage for the accelerometer channels
+ * The SPI frame of the latest accelerometer reading, an address byte and then
+ * a data byte for each channel, so that channel i is in accel[2 * i + 1]. It
+ * is filled by DMA (or the accelerometer FSM) without being copied.
  */
 typedef struct SampleBuffer
 {
-    volatile uint16_t adc[ADC_CHANNELS];
-    volatile uint16_t accel[ACCEL_CHANNELS];
+    volatile uint16_t adc[2][ADC_BLOCK * ADC_CHANNELS];
+    volatile uint8_t accel[2 * ACCEL_CHANNELS];
 } SampleBuffer;
 
+/**
+ * The size in bytes of a packed record, which held every channel of a set of
+ * samples. These are no longer written but are still understood by the
+ * parser.
+ *
+ * Bytes 0-9 and the low nibble of byte 10 hold the seven 12 bit ADC results,
+ * packed two to every three bytes: the first of each pair is in the low byte
+ * and the low nibble of the middle byte, the second in the high nibble of the
+ * middle byte and the high byte. The high nibble of byte 10 is the record tag
+ * and bytes 11-13 are the three accelerometer readings.
+ *
+ * A record with the tag RECORD_GAP instead marks a run of sample sets that
+ * were dropped because the SD ring buffer was full. Bytes 0-3 are the tick
+ * (number of sample sets since the file was opened) of the first set that was
+ * dropped and bytes 4-7 are the number of consecutive sets dropped, both
+ * little endian. The remaining bytes are zero.
+ */
+#define PACKED_LEN 14
+
+/**
+ * The size in bytes of the largest tagged record. Each set of samples is
+ * written to the card as a tagged record holding only the channels that were
+ * due at that tick according to the channel schedule (see ADC_OVERSAMPLE),
+ * and there is one record for every tick.
+ *
+ * Bytes 0 and 1 are a little endian word whose low LOG_CHANNELS bits are the
+ * channel bitmap (bit i is set if channel i is present) and whose high nibble
+ * is the record tag. The present ADC results follow in channel order as a
+ * stream of nibbles, least significant nibble of each result first and with
+ * the first nibble in the low half of each byte. A result takes three nibbles,
+ * or four if the channel is oversampled to more than 12 bits (see
+ * FileInfo::width); twelve bit results therefore pack two to every three bytes
+ * as for PACKED_LEN. The stream is padded to a whole byte and followed by a
+ * byte for each present accelerometer reading.
+ *
+ * A record with the tag RECORD_GAP has an empty bitmap and is followed by the
+ * start tick and count of the dropped sets as for PACKED_LEN, making it
+ * RECORD_GAP_LEN bytes long. A record with the tag RECORD_LATE is the same
+ * but marks sets that were taken and then thrown away, because DMA_ISR() was
+ * held off for so long that their results had been (or may have been)
+ * written over by later blocks.
+ *
+ * A record with the tag RECORD_ACCEL holds one accelerometer reading, which
+ * is logged as soon as the accelerometer has produced it rather than at a
+ * tick. Its bitmap has the accelerometer channels set and byte 2 is the
+ * signed time of the reading, in ADC conversions (one for each enabled ADC
+ * channel to a tick) from the start of the tick of the next sample set in
+ * the file. That is the tick which follows all of the sample sets and gaps
+ * before the record, and the offset can be negative if the reading arrived
+ * after its tick had already been logged. A reading byte for each
+ * accelerometer channel follows, making it RECORD_ACCEL_LEN bytes long.
+ *
+ * A record with the tag RECORD_TIME has an empty bitmap and is followed by a
+ * 32 bit little endian timestamp in microseconds from clock_us(), making it
+ * RECORD_TIME_LEN bytes long. It stamps the record which follows it, which is
+ * always in the same sector: for a set of samples, the time at which
+ * DMA_ISR() started logging the block of ADC_BLOCK sets that it came from,
+ * and for an accelerometer record the time at which its data ready interrupt
+ * was taken. Which records are stamped is set by LOG_STAMP.
+ */
+#define RECORD_MAX_LEN (2 + ADC_CHANNELS * 2 + ACCEL_CHANNELS)
+
+/**
+ * The size in bytes of a tagged gap record.
+ */
+#define RECORD_GAP_LEN 10
+
+/**
+ * The size in bytes of a tagged accelerometer record.
+ */
+#define RECORD_ACCEL_LEN (3 + ACCEL_CHANNELS)
+
+/**
+ * The size in bytes of a tagged timestamp record.
+ */
+#define RECORD_TIME_LEN 6
+
+#if LOG_CHANNELS > 12
+#error "The channel bitmap of a tagged record only has room for 12 channels"
+#endif
+
+/**
+ * Record tag for a set of samples.
+ */
+#define RECORD_SAMPLE 0x0
+
+/**
+ * Record tag for an accelerometer reading.
+ */
+#define RECORD_ACCEL 0x1
+
+/**
+ * Record tag for a timestamp.
+ */
+#define RECORD_TIME 0x2
+
+/**
+ * Record tag for a run of sample sets that were thrown away because they were
+ * read too late.
+ */
+#define RECORD_LATE 0xE
+
+/**
+ * Record tag for a gap marker.
+ */
+#define RECORD_GAP 0xF
+
+/**
+ * The value in the first word of every sector of the data file ("EV" on the
+ * card).
+ */
+#define SECTOR_MAGIC 0x5645
+
+/**
+ * Layout id of the file information sector, which is always the first sector
+ * of the file. It holds a FileInfo rather than records.
+ */
+#define LAYOUT_FILE 0
+
+/**
+ * Channel layout id for records which are a SampleBuffer (ADC_CHANNELS then
+ * ACCEL_CHANNELS, 16 bits each) or a 20 byte gap record starting 0xFFFF. This
+ * is no longer written but is still understood by the parser.
+ */
+#define LAYOUT_RAW 1
+
+/**
+ * Channel layout id for PACKED_LEN byte records (see PACKED_LEN). This is no
+ * longer written but is still understood by the parser.
+ */
+#define LAYOUT_PACKED 2
+
+/**
+ * Channel layout id for sectors compressed by the Rice coder (see rice.c for
+ * the format).
+ */
+#define LAYOUT_RICE 3
+
+/**
+ * Channel layout id for tagged records (see RECORD_MAX_LEN).
+ */
+#define LAYOUT_TAGGED 4
+
+/**
+ * Set non-zero to compress sectors with the Rice coder in the start_logger()
+ * loop before they are written to the card. Sectors are filled with packed
+ * records by the ISR either way.
+ */
+#define LOG_COMPRESS 1
+
+/**
+ * LOG_STAMP setting for no timestamps.
+ */
+#define LOG_STAMP_NONE 0
+
+/**
+ * LOG_STAMP setting to stamp the first set of samples logged from each block.
+ */
+#define LOG_STAMP_BLOCK 1
+
+/**
+ * LOG_STAMP setting to stamp each accelerometer record as well as each block.
+ */
+#define LOG_STAMP_RECORD 2
+
+/**
+ * Which records are preceded by a RECORD_TIME timestamp. Sets of samples are
+ * collected by DMA a block at a time, so one stamp is written per block (with
+ * the first set of the block that is logged) and the sets within the block
+ * are timed from their ticks. With LOG_STAMP_RECORD every accelerometer
+ * reading is stamped too. Each stamp costs RECORD_TIME_LEN bytes before
+ * compression, so this is a trade between card bandwidth and being able to
+ * measure the real timing of the data.
+ */
+#define LOG_STAMP LOG_STAMP_BLOCK
+
+/**
+ * Set non-zero to log in bursts around a trigger rather than continuously.
+ * Whilst waiting for the trigger the SD ring buffer holds the most recent
+ * CAPTURE_PRE_SECTORS sectors of records and nothing is written to the card.
+ * Once a set of samples meets the trigger condition (see CAPTURE_LEVEL and
+ * CAPTURE_SLOPE), CAPTURE_POST more sets are logged and the whole burst is
+ * then written out before waiting for the next trigger. Only the bursts have
+ * to reach the card, so logging frequencies that the card couldn't sustain
+ * are allowed.
+ */
+#define LOG_CAPTURE 0
+
+/**
+ * The ADC channel that is watched for the capture trigger. It must be
+ * enabled, and if it is oversampled then the trigger still sees every sample.
+ */
+#define CAPTURE_CHANNEL 0
+
+/**
+ * Trigger a capture when a sample of CAPTURE_CHANNEL is at least this value,
+ * in raw ADC counts, or 0 for no level trigger.
+ */
+#define CAPTURE_LEVEL 3500
+
+/**
+ * Trigger a capture when a sample of CAPTURE_CHANNEL is at least this much
+ * higher than the one before it, in raw ADC counts, or 0 for no slope
+ * trigger.
+ */
+#define CAPTURE_SLOPE 0
+
+/**
+ * The number of sectors of records before the trigger that are kept in the
+ * SD ring buffer. The rest of the buffer takes the sets after the trigger
+ * whilst the card catches up, and if it fills up then sets are dropped as
+ * usual.
+ */
+#define CAPTURE_PRE_SECTORS 8
+
+/**
+ * The number of sets of samples that are logged after the set which met the
+ * trigger condition.
+ */
+#define CAPTURE_POST 500
+
+#if LOG_CAPTURE && CAPTURE_PRE_SECTORS >= RB_LEN / SD_SECTOR_LEN
+#error "CAPTURE_PRE_SECTORS must leave room in the ring buffer"
+#endif
+
+#if LOG_CAPTURE && !(LOG_ADC_ENABLE & (1U << CAPTURE_CHANNEL))
+#error "CAPTURE_CHANNEL must be enabled in LOG_ADC_ENABLE"
+#endif
+
+/**
+ * The state of a burst capture, see LOG_CAPTURE.
+ */
+typedef enum capture_state_t
+{
+    /// Waiting for the trigger, keeping the recent records in RAM
+    STATE_CAPTURE_ARMED,
+    /// Triggered, logging the sets after the trigger
+    STATE_CAPTURE_POST,
+    /// The burst is over and is being written out, nothing is logged
+    STATE_CAPTURE_FLUSH
+} capture_state_t;
+
+/**
+ * @struct SectorHeader
+ * @brief The header at the start of every SD_SECTOR_LEN byte sector of the
+ * data file. It is followed by SectorHeader::count whole records, and the
+ * rest of the sector is zero. Records never span sectors, so any sector can
+ * be decoded on its own.
+ * @var SectorHeader::magic
+ * Always SECTOR_MAGIC
+ * @var SectorHeader::layout
+ * The layout id of the records in this sector, such as LAYOUT_TAGGED
+ * @var SectorHeader::seq
+ * The number of data sectors written before this one since the file was
+ * opened (zero for the file information sector)
+ * @var SectorHeader::tick
+ * The tick of the first sample set in this sector (the start of the gap if
+ * the first record is a gap marker). Accelerometer records before the first
+ * sample set are timed from this tick too.
+ * @var SectorHeader::count
+ * The number of records in this sector
+ * @var SectorHeader::crc
+ * CRC-16-CCITT (polynomial 0x1021, initial value 0xFFFF) over the whole
+ * sector, calculated with this field set to zero
+ */
+typedef struct SectorHeader
+{
+    uint16_t magic;
+    uint16_t layout;
+    uint32_t seq;
+    uint32_t tick;
+    uint16_t count;
+    uint16_t crc;
+} SectorHeader;
+
+/**
+ * The version of the file format described by FileInfo. Version 5 added
+ * RECORD_TIME records, which moved the Rice coded gap marker to make room.
+ * Version 6 added RECORD_LATE records, which the Rice coder writes as gap
+ * markers with an extra bit. Version 7 allowed ADC channels to be disabled.
+ * Version 8 added FileInfo::post for burst captures.
+ */
+#define FILE_VERSION 8
+
+/**
+ * @struct FileInfo
+ * @brief Describes the whole data file. This follows the SectorHeader (with
+ * layout LAYOUT_FILE and no records) of the first sector in the file, and the
+ * rest of that sector is zero.
+ * @var FileInfo::version
+ * Always FILE_VERSION
+ * @var FileInfo::rate
+ * The logging frequency in Hz, so that ticks can be turned into time
+ * @var FileInfo::adc_channels
+ * The number of ADC channels in each set of samples
+ * @var FileInfo::accel_channels
+ * The number of accelerometer channels in each set of samples
+ * @var FileInfo::divisor
+ * The channel schedule: channel i is present in the sample sets whose tick is
+ * a multiple of divisor[i] (added in version 2), or one less than a multiple
+ * for channels that are oversampled. From version 4 the accelerometer
+ * channels have a divisor of 0, since they are only ever logged in
+ * RECORD_ACCEL records. From version 7 so do ADC channels which are disabled
+ * (see logger_set_channels()), which are never logged, and then a tick is
+ * only as many ADC conversions as there are ADC channels with a non-zero
+ * divisor
+ * @var FileInfo::width
+ * The width in bits of each channel's values, which is more than 12 for
+ * oversampled ADC channels (added in version 3)
+ * @var FileInfo::post
+ * The number of sets of samples logged after each trigger if the file holds
+ * bursts (see LOG_CAPTURE), or 0 if logging was continuous (added in version
+ * 8). In a file of bursts the ticks between bursts aren't logged and
+ * aren't marked as lost either; the sectors of the next burst just carry on
+ * from a later tick
+ */
+typedef struct FileInfo
+{
+    uint16_t version;
+    uint16_t rate;
+    uint16_t adc_channels;
+    uint16_t accel_channels;
+    uint8_t divisor[LOG_CHANNELS];
+    uint8_t width[LOG_CHANNELS];
+    uint32_t post;
+} FileInfo;
+
+/**
+ * The number of records that are sure to fit in a sector after its header.
+ */
+#define SECTOR_RECORDS ((SD_SECTOR_LEN - sizeof(SectorHeader)) / RECORD_MAX_LEN)
+
 void logger_init(void);
-void start_logger(RingBuffer* sdbuf);
-FRESULT sd_write(RingBuffer *rb, char *writebuf, FIL *fil, uint16_t n);
-uint8_t ringbuf_write(RingBuffer* buf, char* data, uint16_t n);
-uint8_t ringbuf_read(RingBuffer *buf, char* read_buffer, uint16_t n);
-void update_lcd(RingBuffer *buf);
+void start_logger(RingBuffer* rb);
+FRESULT sd_write(FIL *fil, char *data, uint16_t n);
+void update_lcd(RingBuffer *rb);
+uint8_t logger_set_rate(uint16_t hz);
+uint8_t logger_set_channels(uint16_t mask);
 void logger_enable(void);
 void logger_disable(void);
 
@@ -11,9 +11,11 @@
  * There are six analogue channels broken out on the development board, plus a
  * user potentiometer. Additionally, there is a CMA3000 3-axis accelerometer
  * which is capable of running at up to 400Hz. The analogue channels (including
- * the pot) are sampled and logged at 1kHz. The accelerometer is also logged at
- * this frequency though analysis of the output will confirm that its value
- * only changes at 400Hz.
+ * the pot) are sampled at 1kHz by default, and all but the pot are logged at
+ * that rate; the pot is oversampled and logged as 14 bit results at 62.5Hz
+ * (see ADC_OVERSAMPLE). The accelerometer produces new data at 400Hz and
+ * signals each reading on its INT line, which is read and logged straight
+ * away with its own timestamp (see RECORD_ACCEL), whatever the logging rate.
  *
  * \section software Software Architecture
  * The software documented here is written specifically for the project, but
@@ -23,25 +25,35 @@
  * source files where they were used as the basis for the code.
  *
  * The main functionality for the datalogger is in the Logger module. The
- * overall architecture overview is that we set up a timer to interrupt at the
- * log frequency, which collects available data and puts it into a buffer ready
- * to be transferred to the SD card. It then invalidates the data and triggers
- * another conversion run such that on the next interrupt, the new data will be
- * ready.
+ * overall architecture overview is that a timer triggers the ADC directly at
+ * the log frequency, and DMA moves the results for a block of ADC_BLOCK ticks
+ * at a time into a sample buffer and then interrupts. The interrupt collects
+ * the data and puts it into a buffer ready to be transferred to the SD card.
+ * The accelerometer's data ready interrupt starts an SPI read of each new
+ * reading, done by DMA on channels borrowed from the SD card driver whenever
+ * it isn't using them, and when that finishes the reading goes into the same
+ * buffer.
  *
- * A software controlled RingBuffer is used to store data before it is
- * transferred to the SD card, and a full ring buffer implementation can be
- * found in the Logger module. This is generic and can be used in other
- * projects. The size of this buffer is controlled by SD_RINGBUF_LEN, and
- * should be as large as possible for best performance but should never be
- * smaller than the sector size (usually 512 bytes for FAT16).
+ * A lock free single producer, single consumer RingBuffer is used to store
+ * data before it is transferred to the SD card, and its implementation can be
+ * found in the ringbuf module. The ISR reserves space for each set of samples
+ * and writes it in place as a tagged record holding only the channels due at
+ * that tick, framed into sectors. Whole sectors are handed to the SD card
+ * straight out of the buffer or, if LOG_COMPRESS is set, are first compressed
+ * by the rice module in the main loop (never in the ISR). The size of the
+ * buffer, RB_LEN, is set at build time to fill the RAM that is not otherwise
+ * needed, including the 2KB USB RAM block which memory.x joins onto main SRAM,
+ * since it sets how long an SD card write stall can be absorbed. The
+ * resulting stall tolerance is reported over the UART at startup.
  *
  * The peripherals are controlled by separate modules, see ADC, Accelerometer,
  * UART particularly. Documentation for how these are configured can be found
  * in the relevant source files; here it suffices to note that CPU time is
  * minimised by use of DMA in the case of the ADC and an interrupt controlled
- * finite state machine (FSM) in the case of the accelerometer. The UART is
- * principally for debugging purposes and is not set up for speed (it currently
+ * finite state machine (FSM) in the case of the accelerometer. Sector data is
+ * moved to and from the SD card by DMA channels 1 and 2, so card transfers no
+ * longer hold off the sampling interrupt. The UART is principally for
+ * debugging purposes and is not set up for speed (it currently
  * busy-waits during transmits) and as such, should not be used in production
  * runs of the firmware builds.
  *
@@ -96,6 +108,9 @@ int main(void)
     // Stop the wdt
     WDTCTL = WDTPW | WDTHOLD;
 
+    // Mark the free RAM so that the stack's worst case can be measured
+    stack_paint();
+
     // Set up the system clock and any required peripherals
     sys_clock_init();
     clock_init();
@@ -0,0 +1,37 @@
+/*
+ * Memory map for the MSP430F5529, used in place of the mspgcc default (the
+ * Makefile puts this directory on the linker search path ahead of the
+ * toolchain's own copy).
+ *
+ * This is the stock map except that the 2KB USB RAM block at 0x1C00, which
+ * sits directly below main SRAM at 0x2400, is folded into the ram region. The
+ * USB module is never enabled so the block behaves as ordinary RAM, and this
+ * gives a single contiguous 10KB region in which the SD ring buffer can be
+ * allocated (see RB_RAM_LEN in ringbuf.h). The stack still starts at the top
+ * of main SRAM.
+ *
+ * Jon Sowman 2014
+ */
+MEMORY {
+  sfr              : ORIGIN = 0x0000, LENGTH = 0x0010 /* END=0x0010, size 16 */
+  peripheral_8bit  : ORIGIN = 0x0010, LENGTH = 0x00f0 /* END=0x0100, size 240 */
+  peripheral_16bit : ORIGIN = 0x0100, LENGTH = 0x0100 /* END=0x0200, size 256 */
+  bsl              : ORIGIN = 0x1000, LENGTH = 0x0800 /* END=0x1800, size 2K as 4 512-byte segments */
+  infomem          : ORIGIN = 0x1800, LENGTH = 0x0200 /* END=0x1a00, size 512 as 4 128-byte segments */
+  infod            : ORIGIN = 0x1800, LENGTH = 0x0080 /* END=0x1880, size 128 */
+  infoc            : ORIGIN = 0x1880, LENGTH = 0x0080 /* END=0x1900, size 128 */
+  infob            : ORIGIN = 0x1900, LENGTH = 0x0080 /* END=0x1980, size 128 */
+  infoa            : ORIGIN = 0x1980, LENGTH = 0x0080 /* END=0x1a00, size 128 */
+  ram (wx)         : ORIGIN = 0x1c00, LENGTH = 0x2800 /* END=0x4400, size 10K (USB RAM + SRAM) */
+  rom (rx)         : ORIGIN = 0x4400, LENGTH = 0xbb80 /* END=0xff80, size 48000 */
+  vectors          : ORIGIN = 0xff80, LENGTH = 0x0080 /* END=0x10000, size 128 as 64 2-byte segments */
+  far_rom          : ORIGIN = 0x00010000, LENGTH = 0x00014400 /* END=0x00024400, size 81K */
+}
+REGION_ALIAS("REGION_TEXT", rom);
+REGION_ALIAS("REGION_DATA", ram);
+REGION_ALIAS("REGION_FAR_ROM", far_rom);
+PROVIDE (__info_segment_size = 0x80);
+PROVIDE (__infod = 0x1800);
+PROVIDE (__infoc = 0x1880);
+PROVIDE (__infob = 0x1900);
+PROVIDE (__infoa = 0x1980);
@@ -13,6 +13,8 @@
 
 #include "diskio.h"             /* Common include file for FatFs and disk I/O layer */
 #include "HAL_SDCard.h"         /* MSP-EXP430F5529 specific SD Card driver */
+#include "system.h"             /* System timebase, for timing writes */
+#include "mmc.h"
 
 /*-------------------------------------------------------------------------*/
 /* Platform dependent macros and functions needed to be modified           */
@@ -29,6 +31,18 @@
 BYTE INS = 1;    // KLQ
 #define	WP              (0)                 /* Card is write protected (yes:true, no:false, default:false) */
 
+/* Streaming writes. When enabled, a WRITE_MULTIPLE_BLOCK session is held open
+   after disk_write() returns and consecutive sectors are fed into it without
+   any further command overhead. The session is closed with STOP_TRAN only when
+   a write is not consecutive, before any other command and on CTRL_SYNC (file
+   sync/close). Set to 0 to issue CMD24/CMD25 on every call for comparison. */
+#define MMC_STREAM      1
+
+/* Attempts at a read before disk_read() gives up. A block is read again when
+   its DMA frame overruns (see SDCard_wait()), which can happen while the ADC
+   holds the DMA controller. */
+#define READ_TRIES      3
+
 /*-------------------------------------------------------------------------*/
 /* Platform dependent RTC Function for FatFs module                        */
 /*-------------------------------------------------------------------------*/
@@ -69,6 +83,9 @@ DWORD get_fattime(void)
 #define	ACMD23	(0x80+23)	/* SET_WR_BLK_ERASE_COUNT (SDC) */
 #define CMD24	(24)		/* WRITE_BLOCK */
 #define CMD25	(25)		/* WRITE_MULTIPLE_BLOCK */
+#define CMD32	(32)		/* ERASE_WR_BLK_START */
+#define CMD33	(33)		/* ERASE_WR_BLK_END */
+#define CMD38	(38)		/* ERASE */
 #define CMD41	(41)		/* SEND_OP_COND (ACMD) */
 #define CMD55	(55)		/* APP_CMD */
 #define CMD58	(58)		/* READ_OCR */
@@ -87,6 +104,19 @@ DSTATUS Stat = STA_NOINIT;	/* Disk status */
 static
 BYTE CardType;			/* b0:MMC, b1:SDv1, b2:SDv2, b3:Block addressing */
 
+static
+BYTE Busy;				/* 1:The card may still be programming the last data written */
+
+LatencyStats WriteLat;	/* Time taken by each disk_write() call, to qualify cards */
+
+#if MMC_STREAM
+static
+BYTE Streaming;			/* 1:A WRITE_MULTIPLE_BLOCK session is open */
+
+static
+DWORD StreamNext;		/* Sector (LBA) the open session will write next */
+#endif
+
 
 
 /*-----------------------------------------------------------------------*/
@@ -94,12 +124,12 @@ BYTE CardType;			/* b0:MMC, b1:SDv1, b2:SDv2, b3:Block addressing */
 /*-----------------------------------------------------------------------*/
 
 static
-void xmit_mmc (
+int xmit_mmc (	/* 1:OK, 0:Frame aborted */
 	const BYTE* buff,               /* Data to be sent */
 	UINT bc                         /* Number of bytes to send */
 )
 {
-    SDCard_sendFrame((uint8_t *)buff, bc);
+    return !SDCard_sendFrame((uint8_t *)buff, bc);
 }
 
 /*-----------------------------------------------------------------------*/
@@ -107,13 +137,13 @@ void xmit_mmc (
 /*-----------------------------------------------------------------------*/
 
 static
-void rcvr_mmc (
+int rcvr_mmc (	/* 1:OK, 0:Frame aborted (overrun or timeout) */
 	BYTE *buff,	/* Pointer to read buffer */
 	UINT bc		/* Number of bytes to receive */
 )
 {
 
-    SDCard_readFrame(buff, bc);
+    return !SDCard_readFrame(buff, bc);
 }
 
 
@@ -130,7 +160,10 @@ int wait_ready (void)    /* 1:OK, 0:Timeout */
 
     for (tmr = 5000; tmr; tmr--) {    /* Wait for ready in timeout of 500ms */
         rcvr_mmc(&d, 1);
-        if (d == 0xFF) return 1;
+        if (d == 0xFF) {
+            Busy = 0;
+            return 1;
+        }
         DLY_US(100);
     }
 
@@ -171,6 +204,34 @@ int select (void)    /* 1:OK, 0:Timeout */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Check once for card ready without waiting                             */
+/*-----------------------------------------------------------------------*/
+
+/* The card holds DO low for as long as it is programming data that it has
+   accepted, which is where a write can stall for hundreds of milliseconds.
+   Rather than spinning in wait_ready(), a caller with other work to do can
+   poll this and only write once the card is ready. Nothing is clocked out
+   unless a write has been made since the card was last seen ready. */
+
+static
+int poll_ready (void)    /* 1:Ready, 0:Busy */
+{
+    BYTE d;
+
+
+    if (Busy) {
+        CS_L();
+        rcvr_mmc(&d, 1);
+        deselect();
+        if (d == 0xFF) Busy = 0;
+    }
+
+    return !Busy;
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Receive a data packet from MMC                                        */
 /*-----------------------------------------------------------------------*/
@@ -192,7 +253,8 @@ int rcvr_datablock (    /* 1:OK, 0:Failed */
     }
     if (d[0] != 0xFE) return 0;        /* If not valid data token, retutn with error */
 
-    rcvr_mmc(buff, btr);            /* Receive the data block into buffer */
+    if (!rcvr_mmc(buff, btr))        /* Receive the data block into buffer */
+        return 0;                    /* The frame was aborted, the block must be read again */
     rcvr_mmc(d, 2);                    /* Discard CRC */
 
     return 1;                        /* Return with success */
@@ -218,18 +280,44 @@ int xmit_datablock (    /* 1:OK, 0:Failed */
     d[0] = token;
     xmit_mmc(d, 1);                /* Xmit a token */
     if (token != 0xFD) {        /* Is it data token? */
-        xmit_mmc(buff, 512);    /* Xmit the 512 byte data block to MMC */
+        if (!xmit_mmc(buff, 512))    /* Xmit the 512 byte data block to MMC */
+            return 0;
         rcvr_mmc(d, 2);            /* Dummy CRC (FF,FF) */
         rcvr_mmc(d, 1);            /* Receive data response */
         if ((d[0] & 0x1F) != 0x05)    /* If not accepted, return with error */
             return 0;
     }
+    Busy = 1;                    /* Programming the block or closing the session */
 
     return 1;
 }
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Close the open streaming write session                                */
+/*-----------------------------------------------------------------------*/
+
+#if MMC_STREAM
+static
+int stream_stop (void)    /* 1:OK, 0:Failed */
+{
+    int res = 1;
+
+
+    if (Streaming) {
+        Streaming = 0;
+        if (!select() || !xmit_datablock(0, 0xFD))    /* STOP_TRAN token */
+            res = 0;
+        deselect();
+    }
+
+    return res;
+}
+#endif
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Send a command packet to MMC                                          */
 /*-----------------------------------------------------------------------*/
@@ -243,6 +331,10 @@ BYTE send_cmd (        /* Returns command response (bit7==1:Send failed)*/
     BYTE n, d, buf[6];
 
 
+#if MMC_STREAM
+    stream_stop();        /* No command can be sent inside a write session */
+#endif
+
     if (cmd & 0x80) {    /* ACMD<n> is the command sequense of CMD55-CMD<n> */
         cmd &= 0x7F;
         n = send_cmd(CMD55, 0);
@@ -406,6 +498,7 @@ DRESULT disk_read (
 )
 {
     DSTATUS s;
+    BYTE tries;
 
 
     s = disk_status(drv);
@@ -413,21 +506,26 @@ DRESULT disk_read (
     if (!count) return RES_PARERR;
     if (!(CardType & CT_BLOCK)) sector *= 512;    /* Convert LBA to byte address if needed */
 
-    if (count == 1) {    /* Single block read */
-        if ((send_cmd(CMD17, sector) == 0)    /* READ_SINGLE_BLOCK */
-            && rcvr_datablock(buff, 512))
-            count = 0;
-    }
-    else {                /* Multiple block read */
-        if (send_cmd(CMD18, sector) == 0) {    /* READ_MULTIPLE_BLOCK */
-            do {
-                if (!rcvr_datablock(buff, 512)) break;
-                buff += 512;
-            } while (--count);
-            send_cmd(CMD12, 0);                /* STOP_TRANSMISSION */
+    /* A block whose frame was aborted (see SDCard_wait()) is read again,
+       carrying on from the first block that wasn't read */
+    for (tries = READ_TRIES; count && tries; tries--) {
+        if (count == 1) {    /* Single block read */
+            if ((send_cmd(CMD17, sector) == 0)    /* READ_SINGLE_BLOCK */
+                && rcvr_datablock(buff, 512))
+                count = 0;
+        }
+        else {                /* Multiple block read */
+            if (send_cmd(CMD18, sector) == 0) {    /* READ_MULTIPLE_BLOCK */
+                do {
+                    if (!rcvr_datablock(buff, 512)) break;
+                    buff += 512;
+                    sector += (CardType & CT_BLOCK) ? 1 : 512;
+                } while (--count);
+                send_cmd(CMD12, 0);                /* STOP_TRANSMISSION */
+            }
         }
+        deselect();
     }
-    deselect();
 
     return count ? RES_ERROR : RES_OK;
 }
@@ -446,12 +544,39 @@ DRESULT disk_write (
 )
 {
     DSTATUS s;
+    DWORD t;
+    BYTE n;
 
 
     s = disk_status(drv);
     if (s & STA_NOINIT) return RES_NOTRDY;
     if (s & STA_PROTECT) return RES_WRPRT;
     if (!count) return RES_PARERR;
+    t = clock_us();
+    n = count;
+
+#if MMC_STREAM
+    if (!Streaming || sector != StreamNext) {    /* Not a continuation, open a new session */
+        if (count > 1 && (CardType & CT_SDC))    /* Let the card pre-erase the blocks we know are coming */
+            send_cmd(ACMD23, count);
+        if (send_cmd(CMD25, (CardType & CT_BLOCK) ? sector : sector * 512) != 0) {
+            deselect();
+            return RES_ERROR;
+        }
+        Streaming = 1;
+    } else if (!select()) {                        /* Continue the open session */
+        Streaming = 0;
+        return RES_ERROR;
+    }
+    do {
+        if (!xmit_datablock(buff, 0xFC)) break;
+        buff += 512;
+        sector++;
+    } while (--count);
+    StreamNext = sector;
+    deselect();
+    if (count) stream_stop();                    /* Abandon the session on error */
+#else
     if (!(CardType & CT_BLOCK)) sector *= 512;    /* Convert LBA to byte address if needed */
 
     if (count == 1) {    /* Single block write */
@@ -471,6 +596,8 @@ DRESULT disk_write (
         }
     }
     deselect();
+#endif
+    lat_add(&WriteLat, clock_us() - t, n);
 
     return count ? RES_ERROR : RES_OK;
 }
@@ -490,6 +617,7 @@ DRESULT disk_ioctl (
     DRESULT res;
     BYTE n, csd[16];
     WORD cs;
+    DWORD *dp, st, ed;
 
 
     if (disk_status(drv) & STA_NOINIT)                    /* Check if card is in the socket */
@@ -498,6 +626,9 @@ DRESULT disk_ioctl (
     res = RES_ERROR;
     switch (ctrl) {
         case CTRL_SYNC :        /* Make sure that no pending write process */
+#if MMC_STREAM
+            stream_stop();        /* Sync point, close any open write session */
+#endif
             if (select()) {
                 deselect();
                 res = RES_OK;
@@ -523,6 +654,24 @@ DRESULT disk_ioctl (
             res = RES_OK;
             break;
 
+        case CTRL_ERASE_SECTOR :    /* Erase a block of sectors (for f_expand() and _USE_ERASE) */
+            if (!(CardType & CT_SDC)) break;                /* Check if the card is SDC */
+            dp = buff; st = dp[0]; ed = dp[1];                /* Load sector block */
+            if (!(CardType & CT_BLOCK)) {
+                st *= 512; ed *= 512;
+            }
+            if (send_cmd(CMD32, st) == 0 && send_cmd(CMD33, ed) == 0 && send_cmd(CMD38, 0) == 0) {    /* Erase sector block */
+                Busy = 1;
+                for (n = 60; n && !wait_ready(); n--) ;    /* Wait for end of erase in timeout of 30s */
+                if (n) res = RES_OK;
+            }
+            break;
+
+        case MMC_GET_BUSY :        /* Check once whether the card is still programming (BYTE) */
+            *(BYTE*)buff = !poll_ready();
+            res = RES_OK;
+            break;
+
         default:
             res = RES_PARERR;
     }
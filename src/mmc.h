@@ -1 +1,6 @@
+#include "latency.h"
+
 uint8_t detectCard(void);
+
+/* The time taken by each disk_write() call */
+extern LatencyStats WriteLat;
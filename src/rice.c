@@ -0,0 +1,326 @@
+/**
+ * A lossless compressor for sets of samples, which codes the difference of
+ * each channel from its previous value with an adaptive Rice code. The signals
+ * we log change slowly compared to the sample rate, so most differences are
+ * small and take only a few bits.
+ *
+ * Output is written a sector at a time and each sector can be decoded on its
+ * own. After the sector header the sector is a stream of bits, most
+ * significant bit of each byte first, holding SectorHeader::count records.
+ * Each record starts with one to three flag bits:
+ *
+ * - 0: A set of samples. Only the channels present in the set are written, in
+ *   channel order. Which channels are present is not written, since it
+ *   follows from the tick of the set and the channel schedule (see
+ *   FileInfo::divisor). The first time a channel is written in the sector it
+ *   is at full width (see FileInfo::width; 12 bits for ADC channels unless
+ *   they are oversampled, 8 for accelerometer channels). After that the
+ *   channel's difference d from its previous value is mapped to z = 2d for
+ *   d >= 0 or -2d - 1 for d < 0, and written as z >> k one bits, a zero bit
+ *   and then the low k bits of z. If z >> k would be RICE_ESC or more then
+ *   RICE_ESC one bits are written followed by the channel value at full
+ *   width instead.
+ * - 100: A gap marker, followed by one bit for why the sample sets were lost
+ *   (0 for RECORD_GAP, 1 for RECORD_LATE) and then the start tick and the
+ *   count of lost sample sets, 32 bits each.
+ * - 101: A timestamp (see RECORD_TIME). The first two timestamps in the
+ *   sector are written as 32 bits. Timestamps usually come at a steady rate,
+ *   so after that the step s from the previous timestamp is worked out and
+ *   the change in step d = s - s' is written, where s' is the step before.
+ *   d is coded as for a channel difference, with its own running average,
+ *   except that RICE_ESC one bits are followed by the full 32 bit timestamp,
+ *   as they are if d is more than RICE_TIME_MAX either way.
+ * - 11: An accelerometer reading, followed by its 8 bit signed time offset
+ *   (see RECORD_ACCEL) and then the accelerometer channels, coded as for a
+ *   set of samples.
+ *
+ * The Rice parameter k is chosen per channel from a running average of that
+ * channel's z values, acc, which starts each sector at RICE_ACC_INIT and is
+ * updated to acc - acc / 4 + z after every coded difference, or to
+ * RICE_ACC_MAX if that is less. k is then the smallest value (up to 12) for
+ * which 4 << k is greater than acc.
+ *
+ * @file rice.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup rice
+ * @{
+ */
+
+#include <string.h>
+#include "rice.h"
+
+/**
+ * Write the low n bits of v into the sector, most significant first.
+ *
+ * @param e A pointer to the encoder
+ * @param v The value to be written
+ * @param n The number of bits to write, no more than 16
+ */
+static void put_bits(RiceEncoder *e, uint16_t v, uint8_t n)
+{
+    uint16_t mask;
+
+    if(!n)
+        return;
+
+    for(mask = 1U << (n - 1); mask; mask >>= 1)
+    {
+        if(v & mask)
+            e->buf[e->bit >> 3] |= 0x80 >> (e->bit & 7);
+        e->bit++;
+    }
+}
+
+/**
+ * Write n one bits into the sector.
+ *
+ * @param e A pointer to the encoder
+ * @param n The number of one bits to write
+ */
+static void put_ones(RiceEncoder *e, uint16_t n)
+{
+    while(n--)
+    {
+        e->buf[e->bit >> 3] |= 0x80 >> (e->bit & 7);
+        e->bit++;
+    }
+}
+
+/**
+ * Choose the Rice parameter for a channel from its running average.
+ *
+ * @param acc The running average, four times the mean coded value
+ * @returns The Rice parameter k
+ */
+static uint8_t rice_k(uint16_t acc)
+{
+    uint8_t k = 0;
+
+    while(k < 12 && (4U << k) <= acc)
+        k++;
+    return k;
+}
+
+/**
+ * Update a running average with a newly coded value, holding it at
+ * RICE_ACC_MAX rather than letting it wrap.
+ *
+ * @param acc The running average
+ * @param z The coded value
+ * @returns The new running average
+ */
+static uint16_t rice_average(uint16_t acc, uint16_t z)
+{
+    acc -= acc >> 2;
+    return z > RICE_ACC_MAX - acc ? RICE_ACC_MAX : acc + z;
+}
+
+/**
+ * Start a new output sector. The sector is cleared and records are written
+ * after the first offset bytes, which are left for the caller's header.
+ *
+ * @param e A pointer to the encoder
+ * @param buf A pointer to the SD_SECTOR_LEN byte sector to write into
+ * @param offset The number of bytes to leave at the start of the sector
+ * @param width The full width in bits of each channel's values, which must
+ * stay valid whilst the sector is written
+ */
+void rice_start(RiceEncoder *e, char *buf, uint16_t offset,
+        const uint8_t *width)
+{
+    uint8_t i;
+
+    memset(buf, 0, SD_SECTOR_LEN);
+    e->buf = buf;
+    e->bit = offset * 8;
+    e->count = 0;
+    e->width = width;
+    e->have_prev = 0;
+    for(i = 0; i < RICE_CHANNELS; i++)
+        e->acc[i] = RICE_ACC_INIT;
+    e->have_us = 0;
+    e->us_acc = RICE_ACC_INIT;
+}
+
+/**
+ * Code a record holding some channel values into the current sector.
+ *
+ * @param e A pointer to the encoder
+ * @param v A pointer to RICE_CHANNELS channel values, of which only those in
+ * mask are used
+ * @param mask Channel bitmap of the channels to code
+ * @param head The flag bits and any other fields that start the record
+ * @param head_bits The number of bits in head, no more than 16
+ * @returns 1 if the record was written, 0 if it doesn't fit in what is left
+ * of the sector (in which case nothing is written)
+ */
+static uint8_t rice_values(RiceEncoder *e, uint16_t *v, uint16_t mask,
+        uint16_t head, uint8_t head_bits)
+{
+    uint16_t z[RICE_CHANNELS];
+    uint8_t k[RICE_CHANNELS];
+    uint16_t bits = head_bits, q;
+    int16_t d;
+    uint8_t i;
+
+    // Work out how much space the set needs first
+    for(i = 0; i < RICE_CHANNELS; i++)
+    {
+        if(!(mask & (1U << i)))
+            continue;
+        if(!(e->have_prev & (1U << i)))
+        {
+            bits += e->width[i];
+            continue;
+        }
+        d = v[i] - e->prev[i];
+        z[i] = d >= 0 ? 2 * d : -2 * d - 1;
+        k[i] = rice_k(e->acc[i]);
+        q = z[i] >> k[i];
+        bits += q < RICE_ESC ? q + 1 + k[i] : RICE_ESC + e->width[i];
+    }
+    if(e->bit + bits > SD_SECTOR_LEN * 8)
+        return 0;
+
+    put_bits(e, head, head_bits);
+    for(i = 0; i < RICE_CHANNELS; i++)
+    {
+        if(!(mask & (1U << i)))
+            continue;
+        if(e->have_prev & (1U << i))
+        {
+            q = z[i] >> k[i];
+            if(q < RICE_ESC)
+            {
+                put_ones(e, q);
+                put_bits(e, 0, 1);
+                put_bits(e, z[i], k[i]);
+            } else {
+                put_ones(e, RICE_ESC);
+                put_bits(e, v[i], e->width[i]);
+            }
+            e->acc[i] = rice_average(e->acc[i], z[i]);
+        } else {
+            put_bits(e, v[i], e->width[i]);
+        }
+        e->prev[i] = v[i];
+    }
+
+    e->have_prev |= mask;
+    e->count++;
+    return 1;
+}
+
+/**
+ * Code a set of samples into the current sector.
+ *
+ * @param e A pointer to the encoder
+ * @param v A pointer to RICE_CHANNELS channel values, of which only those in
+ * mask are used
+ * @param mask Channel bitmap of the channels present in the set
+ * @returns 1 if the set was written, 0 if it doesn't fit in what is left of
+ * the sector (in which case nothing is written)
+ */
+uint8_t rice_sample(RiceEncoder *e, uint16_t *v, uint16_t mask)
+{
+    return rice_values(e, v, mask, 0, 1);
+}
+
+/**
+ * Code an accelerometer reading into the current sector.
+ *
+ * @param e A pointer to the encoder
+ * @param v A pointer to RICE_CHANNELS channel values, of which only the
+ * accelerometer channels are used
+ * @param offset The time offset of the reading, see RECORD_ACCEL
+ * @returns 1 if the reading was written, 0 if it doesn't fit in what is left
+ * of the sector (in which case nothing is written)
+ */
+uint8_t rice_accel(RiceEncoder *e, uint16_t *v, uint8_t offset)
+{
+    return rice_values(e, v, LOG_ACCEL_MASK, 0x300 | offset, 10);
+}
+
+/**
+ * Code a gap marker into the current sector.
+ *
+ * @param e A pointer to the encoder
+ * @param start The tick of the first sample set that was lost
+ * @param count The number of sample sets that were lost
+ * @param late 1 if the sets were read too late (RECORD_LATE), 0 if they were
+ * dropped (RECORD_GAP)
+ * @returns 1 if the marker was written, 0 if it doesn't fit in what is left
+ * of the sector (in which case nothing is written)
+ */
+uint8_t rice_gap(RiceEncoder *e, uint32_t start, uint32_t count, uint8_t late)
+{
+    if(e->bit + 68 > SD_SECTOR_LEN * 8)
+        return 0;
+
+    put_bits(e, 8 | (late ? 1 : 0), 4);
+    put_bits(e, start >> 16, 16);
+    put_bits(e, start, 16);
+    put_bits(e, count >> 16, 16);
+    put_bits(e, count, 16);
+
+    e->count++;
+    return 1;
+}
+
+/**
+ * Code a timestamp into the current sector.
+ *
+ * @param e A pointer to the encoder
+ * @param us The timestamp in microseconds
+ * @returns 1 if the timestamp was written, 0 if it doesn't fit in what is
+ * left of the sector (in which case nothing is written)
+ */
+uint8_t rice_time(RiceEncoder *e, uint32_t us)
+{
+    uint32_t step = us - e->us_prev;
+    int32_t d = step - e->us_step;
+    uint16_t z = 0, q = RICE_ESC, bits = 3;
+    uint8_t k = 0, small;
+
+    // Work out how much space the timestamp needs first
+    small = e->have_us > 1 && d >= -RICE_TIME_MAX && d <= RICE_TIME_MAX;
+    if(small)
+    {
+        z = d >= 0 ? 2 * d : -2 * d - 1;
+        k = rice_k(e->us_acc);
+        q = z >> k;
+    }
+    if(q < RICE_ESC)
+        bits += q + 1 + k;
+    else
+        bits += (e->have_us > 1 ? RICE_ESC : 0) + 32;
+    if(e->bit + bits > SD_SECTOR_LEN * 8)
+        return 0;
+
+    put_bits(e, 5, 3);
+    if(q < RICE_ESC)
+    {
+        put_ones(e, q);
+        put_bits(e, 0, 1);
+        put_bits(e, z, k);
+    } else {
+        if(e->have_us > 1)
+            put_ones(e, RICE_ESC);
+        put_bits(e, us >> 16, 16);
+        put_bits(e, us, 16);
+    }
+    if(small)
+        e->us_acc = rice_average(e->us_acc, z);
+
+    if(e->have_us < 2)
+        e->have_us++;
+    e->us_step = step;
+    e->us_prev = us;
+    e->count++;
+    return 1;
+}
+
+/**
+ * @}
+ */
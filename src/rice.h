@@ -0,0 +1,105 @@
+/**
+ * Rice coder header.
+ *
+ * @file rice.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup rice
+ * @{
+ */
+
+#ifndef __RICE_H__
+#define __RICE_H__
+
+#include "typedefs.h"
+#include "logger.h"
+
+/**
+ * The number of channels in each set of samples.
+ */
+#define RICE_CHANNELS LOG_CHANNELS
+
+/**
+ * The longest unary quotient that will be written. A value whose quotient
+ * would be this long or longer is instead written as this many one bits
+ * followed by the value itself at full width.
+ */
+#define RICE_ESC 16
+
+/**
+ * The starting value of each channel's running average when a sector is
+ * started, which gives a Rice parameter of 2.
+ */
+#define RICE_ACC_INIT 16
+
+/**
+ * The most that a running average can reach. The average settles at four
+ * times the coded values, which for a 14 bit channel stepping full scale is
+ * over 130000, so it is held here rather than being left to wrap.
+ */
+#define RICE_ACC_MAX 0xFFFF
+
+/**
+ * The largest change in the step between timestamps that is Rice coded,
+ * rather than escaped to the full timestamp.
+ */
+#define RICE_TIME_MAX 8191
+
+/**
+ * @struct RiceEncoder
+ * The state of the compressor for one output sector.
+ * @var RiceEncoder::buf
+ * The sector being written, of SD_SECTOR_LEN bytes.
+ * @var RiceEncoder::bit
+ * The number of bits of the sector used so far, including the header.
+ * @var RiceEncoder::count
+ * The number of records in the sector.
+ * @var RiceEncoder::width
+ * The full width in bits of each channel's values.
+ * @var RiceEncoder::have_prev
+ * Channel bitmap of the channels that have been written to the sector, after
+ * which they are coded as differences from RiceEncoder::prev.
+ * @var RiceEncoder::prev
+ * The last value written for each channel.
+ * @var RiceEncoder::acc
+ * A running average of each channel's coded values, four times the mean,
+ * from which the Rice parameter is chosen.
+ * @var RiceEncoder::have_us
+ * The number of timestamps written to the sector so far, up to 2. Only the
+ * first two are written in full.
+ * @var RiceEncoder::us_prev
+ * The last timestamp written.
+ * @var RiceEncoder::us_step
+ * The step from the timestamp before that to RiceEncoder::us_prev.
+ * @var RiceEncoder::us_acc
+ * The running average of the coded timestamp values, as for
+ * RiceEncoder::acc.
+ */
+typedef struct RiceEncoder
+{
+    char *buf;
+    uint16_t bit;
+    uint16_t count;
+    const uint8_t *width;
+    uint16_t have_prev;
+    uint16_t prev[RICE_CHANNELS];
+    uint16_t acc[RICE_CHANNELS];
+    uint8_t have_us;
+    uint32_t us_prev;
+    uint32_t us_step;
+    uint16_t us_acc;
+} RiceEncoder;
+
+void rice_start(RiceEncoder *e, char *buf, uint16_t offset,
+        const uint8_t *width);
+uint8_t rice_sample(RiceEncoder *e, uint16_t *v, uint16_t mask);
+uint8_t rice_accel(RiceEncoder *e, uint16_t *v, uint8_t offset);
+uint8_t rice_gap(RiceEncoder *e, uint32_t start, uint32_t count,
+        uint8_t late);
+uint8_t rice_time(RiceEncoder *e, uint32_t us);
+
+#endif /* __RICE_H__ */
+
+/**
+ * @}
+ */
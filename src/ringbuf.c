@@ -0,0 +1,156 @@
+/**
+ * A lock free ring buffer for passing data from a single producer (such as an
+ * interrupt service routine) to a single consumer (such as the main loop).
+ *
+ * The producer reserves space for a record, writes it in place and then
+ * commits it. Reservations are always contiguous; one that would run off the
+ * end of the buffer is written into slack space after the end and moved round
+ * to the start when it is committed, so the producer never has to split a
+ * record. The consumer is given the longest contiguous span of committed data
+ * available and releases it once it has finished with it.
+ *
+ * @file ringbuf.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup ringbuf
+ * @{
+ */
+
+#include <string.h>
+#include "ringbuf.h"
+
+/**
+ * Quick facility to turn a RingBuffer index into an offset into the buffer.
+ * @param i The index, which must be less than twice RB_LEN
+ */
+#define rb_offset_m(i) ((i) >= RB_LEN ? (i) - RB_LEN : (i))
+
+/**
+ * Quick facility to move a RingBuffer index on by n bytes.
+ * @param i The index, which must be less than twice RB_LEN
+ * @param n The number of bytes to move on by, no more than RB_LEN
+ */
+#define rb_advance_m(i, n) ((i) + (n) >= 2 * RB_LEN ? \
+        (i) + (n) - 2 * RB_LEN : (i) + (n))
+
+/**
+ * Reset a RingBuffer to its original empty state. Neither the producer nor
+ * the consumer may be using the buffer whilst this is called.
+ *
+ * @param rb A pointer to the ring buffer we wish to reset
+ */
+void rb_reset(RingBuffer *rb)
+{
+    rb->head = rb->tail = 0;
+    rb->overflow = 0;
+}
+
+/**
+ * Get the number of bytes in a RingBuffer that have been committed and not yet
+ * released. Either side may call this; each index is only read once so the
+ * result is consistent even if the other side is running.
+ *
+ * @param rb A pointer to the ring buffer which we wish to query
+ * @returns The number of bytes in use
+ */
+uint16_t rb_getused(RingBuffer *rb)
+{
+    uint16_t head = rb->head;
+    uint16_t tail = rb->tail;
+
+    if(head >= tail)
+        return head - tail;
+    return head + 2 * RB_LEN - tail;
+}
+
+/**
+ * Reserve n contiguous bytes at the head of a RingBuffer. Only the producer
+ * may call this.
+ *
+ * The space is not visible to the consumer until it is given to rb_commit(),
+ * and a further reservation before then will return the same space.
+ *
+ * @param rb A pointer to the ring buffer we want to write to
+ * @param n The number of bytes to reserve, no more than RB_RESERVE_MAX
+ * @returns A pointer to the reserved space, or NULL if there is not enough
+ * free space (in which case the overflow flag is set)
+ */
+char* rb_reserve(RingBuffer *rb, uint16_t n)
+{
+    if(n > RB_RESERVE_MAX)
+        return NULL;
+
+    if(RB_LEN - rb_getused(rb) < n)
+    {
+        rb->overflow = 1;
+        return NULL;
+    }
+
+    return rb->buf + rb_offset_m(rb->head);
+}
+
+/**
+ * Commit n bytes previously reserved with rb_reserve() such that they are
+ * visible to the consumer. Only the producer may call this.
+ *
+ * @param rb A pointer to the ring buffer we want to write to
+ * @param n The number of bytes to commit, no more than was reserved
+ */
+void rb_commit(RingBuffer *rb, uint16_t n)
+{
+    uint16_t head = rb->head;
+    uint16_t i = rb_offset_m(head);
+
+    // If the record ran into the slack then move that part round to the
+    // start, which rb_reserve() has already checked is free
+    if(i + n > RB_LEN)
+        memcpy(rb->buf, rb->buf + RB_LEN, i + n - RB_LEN);
+
+    // The data must be in place before the consumer can see it
+    rb->head = rb_advance_m(head, n);
+}
+
+/**
+ * Find the oldest committed data in a RingBuffer. Only the consumer may call
+ * this.
+ *
+ * The data remains owned by the caller until it is given back with
+ * rb_release(). Data which wraps around the end of the buffer is returned by
+ * the next call once the first part has been released.
+ *
+ * @param rb A pointer to the ring buffer we want to read from
+ * @param n Set to the number of contiguous bytes available at the returned
+ * pointer, this is 0 if the buffer is empty
+ * @returns A pointer to the oldest committed byte
+ */
+char* rb_peek(RingBuffer *rb, uint16_t *n)
+{
+    uint16_t i = rb_offset_m(rb->tail);
+    uint16_t used = rb_getused(rb);
+
+    // Don't run off the end of the buffer
+    if(used > RB_LEN - i)
+        used = RB_LEN - i;
+
+    *n = used;
+    return rb->buf + i;
+}
+
+/**
+ * Give n bytes back to a RingBuffer once the consumer has finished with them
+ * such that the producer can use the space again. Only the consumer may call
+ * this.
+ *
+ * @param rb A pointer to the ring buffer
+ * @param n The number of bytes to release, no more than rb_peek() returned
+ */
+void rb_release(RingBuffer *rb, uint16_t n)
+{
+    uint16_t tail = rb->tail;
+
+    rb->tail = rb_advance_m(tail, n);
+}
+
+/**
+ * @}
+ */
@@ -0,0 +1,101 @@
+/**
+ * Ring buffer header.
+ *
+ * @file ringbuf.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ * @addtogroup ringbuf
+ * @{
+ */
+
+#ifndef __RINGBUF_H__
+#define __RINGBUF_H__
+
+#include "typedefs.h"
+#include "ffconf.h"
+
+/**
+ * The total RAM available to the linker. The MSP430F5529 has 8KB of main
+ * SRAM at 0x2400 and directly below it a 2KB block at 0x1C00 intended for the
+ * USB module. We don't use USB, so memory.x joins the two into a single 10KB
+ * region.
+ */
+#define RB_RAM_LEN (10 * 1024)
+
+/**
+ * The amount of RAM that must be left for everything other than the ring
+ * buffer: the LCD frame buffer (818 bytes), the fatfs filesystem object
+ * (around 560 bytes, plus a sector for each buffer of its FAT cache), the
+ * compressor's output sector (512 bytes), other globals and the stack. The
+ * link only fails if the globals alone don't fit. The linker doesn't know
+ * how deep the stack goes, so if this leaves too little for it the stack
+ * grows down into the ring buffer at run time and corrupts it. The stack's
+ * deepest point so far is reported over the UART each time a file is closed
+ * (see stack_unused()), from a run which should include writes that extend
+ * the FAT and the ISRs, and this must leave room for it.
+ */
+#define RB_RAM_RESERVE (3072 + _FAT_CACHE * 512)
+
+/**
+ * The largest single reservation that may be made with rb_reserve(). A
+ * reservation that runs off the end of the buffer is written into this many
+ * bytes of slack after it, and moved round to the start on rb_commit().
+ */
+#define RB_RESERVE_MAX 64
+
+/**
+ * The granularity of the ring buffer size. The consumer takes whole SD card
+ * sectors so the buffer must be a whole number of them.
+ */
+#define RB_ALIGN 512
+
+/**
+ * The size of the ring buffer in bytes. This is calculated at build time as
+ * the largest whole number of sectors that fits in the RAM left over once
+ * RB_RAM_RESERVE has been set aside.
+ */
+#define RB_LEN (((RB_RAM_LEN - RB_RAM_RESERVE - RB_RESERVE_MAX) / RB_ALIGN) \
+        * RB_ALIGN)
+
+/**
+ * @struct RingBuffer
+ * A single producer, single consumer ring buffer. The producer (typically an
+ * ISR) writes records in place using rb_reserve() and rb_commit(), the
+ * consumer takes contiguous spans with rb_peek() and rb_release().
+ *
+ * Both indices count over twice the length of the buffer and are only
+ * reduced to an offset when used, so that a full buffer can be told apart
+ * from an empty one. Wrapping is done by comparison and subtraction rather
+ * than by a (slow) division, so the buffer can be any size. Each index is
+ * written by only one side and is a single 16 bit word, so no locking is
+ * needed between the two.
+ * @var RingBuffer::buf
+ * The buffer storage, plus slack for reservations that wrap.
+ * @var RingBuffer::head
+ * The index of the next byte to commit, only written by the producer.
+ * @var RingBuffer::tail
+ * The index of the next byte to release, only written by the consumer.
+ * @var RingBuffer::overflow
+ * A flag that will be set non-zero if a reservation fails because the buffer
+ * is full.
+ */
+typedef struct RingBuffer
+{
+    char buf[RB_LEN + RB_RESERVE_MAX];
+    volatile uint16_t head;
+    volatile uint16_t tail;
+    volatile uint8_t overflow;
+} RingBuffer;
+
+void rb_reset(RingBuffer *rb);
+uint16_t rb_getused(RingBuffer *rb);
+char* rb_reserve(RingBuffer *rb, uint16_t n);
+void rb_commit(RingBuffer *rb, uint16_t n);
+char* rb_peek(RingBuffer *rb, uint16_t *n);
+void rb_release(RingBuffer *rb, uint16_t n);
+
+#endif /* __RINGBUF_H__ */
+
+/**
+ * @}
+ */
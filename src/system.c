@@ -26,7 +26,20 @@
 static volatile clock_time_t ticks;
 
 /**
- * Use timer A0 to set up a system clock ticking at 1ms intervals.
+ * The end of the statically allocated RAM, from the linker. The stack grows
+ * down from the top of RAM towards it.
+ */
+extern char _end;
+
+/**
+ * The first word above the globals, the lowest that the stack can reach
+ * before it runs into them.
+ */
+#define stack_limit_m() ((uint16_t *)(((uintptr_t)&_end + 1) & ~1U))
+
+/**
+ * Use timer A1 to set up a system clock ticking at 1ms intervals. Timer A0 is
+ * left for the logger, since only its outputs can trigger the ADC.
  */
 void clock_init(void)
 {
@@ -34,13 +47,13 @@ void clock_init(void)
     ticks = 0;
 
     // Count to 24999 (25000 actual counts)
-    TA0CCR0 = 24999;
+    TA1CCR0 = 24999;
 
     // Clock from SMCLK with no divider, use "up" mode, use interrupts
-    TA0CTL |= TASSEL_2 | MC_1 | TACLR;
+    TA1CTL |= TASSEL_2 | MC_1 | TACLR;
 
     // CCR0 interrupt enable
-    TA0CCTL0 |= CCIE;
+    TA1CCTL0 |= CCIE;
 
     // Enable global interrupts (macro from legacymsp430.h) and return
     eint();
@@ -109,12 +122,77 @@ void sys_clock_init(void)
 }
 
 /**
- * Return the current system time.
+ * Read the tick count and the current value of TA1 together. Interrupts are
+ * held off whilst we do so and then left as they were, so this is safe to
+ * call from an ISR as well as from the main loop.
+ * @param r A pointer to where the value of TA1 is stored.
+ * @returns The tick count, including a wrap of TA1 that the tick ISR hasn't
+ * counted yet.
+ */
+static clock_time_t clock_read(uint16_t *r)
+{
+    uint16_t gie = __read_status_register() & GIE;
+    clock_time_t t;
+
+    __disable_interrupt();
+    *r = TA1R;
+    t = ticks;
+    // The counter may have wrapped without the tick ISR having run yet
+    if((TA1CCTL0 & CCIFG) && *r < (TA1CCR0 / 2))
+        t++;
+    __bis_SR_register(gie);
+
+    return t;
+}
+
+/**
+ * Return the current system time. The tick count is 32 bits, so it is read
+ * with interrupts held off to stop the tick ISR changing it half way through.
  * @returns The current clock time in milliseconds.
  */
 clock_time_t clock_time(void)
 {
-    return ticks;
+    uint16_t gie = __read_status_register() & GIE;
+    clock_time_t t;
+
+    __disable_interrupt();
+    t = ticks;
+    __bis_SR_register(gie);
+
+    return t;
+}
+
+/**
+ * Return a fine grained timestamp for measuring short intervals, in SMCLK
+ * cycles. This combines the tick count with the current value of TA1 and
+ * wraps roughly every three minutes, so it should only be used to take the
+ * difference between two nearby timestamps.
+ * @returns The number of SMCLK cycles since the clock was started.
+ */
+uint32_t clock_cycles(void)
+{
+    clock_time_t t;
+    uint16_t r;
+
+    t = clock_read(&r);
+    return t * (TA1CCR0 + 1UL) + r;
+}
+
+/**
+ * Return a monotonic timestamp in microseconds, for stamping data. This
+ * combines the tick count with the current value of TA1, so it keeps counting
+ * whether or not we are logging and whatever the logging rate. It wraps every
+ * 2^32us (about 71 minutes), so a reader has to unwrap a sequence of
+ * timestamps that are closer together than that.
+ * @returns The number of microseconds since the clock was started.
+ */
+uint32_t clock_us(void)
+{
+    clock_time_t t;
+    uint16_t r;
+
+    t = clock_read(&r);
+    return t * 1000 + r / (uint16_t)(F_CPU / 1000000UL);
 }
 
 /**
@@ -132,11 +210,45 @@ void _delay_ms(clock_time_t delay)
     }
 }
 
+/**
+ * Fill the RAM between the end of the globals and the stack with
+ * STACK_PAINT, so that stack_unused() can later tell how far down the stack
+ * has reached. This must be called at the start of main(), before any
+ * interrupts are enabled.
+ */
+void stack_paint(void)
+{
+    uint16_t *p = stack_limit_m();
+    uint16_t *sp = (uint16_t *)__read_stack_pointer();
+
+    // Leave a few words below the stack pointer for this function
+    while(p < sp - 8)
+        *p++ = STACK_PAINT;
+}
+
+/**
+ * Find how much of the stack has never been used since stack_paint(), by
+ * counting the words above the globals that still hold STACK_PAINT. If this
+ * is 0 then the stack has run into the globals at some point.
+ * @returns The number of bytes between the lowest point that the stack has
+ * reached and the end of the globals
+ */
+uint16_t stack_unused(void)
+{
+    uint16_t *p = stack_limit_m();
+    uint16_t *sp = (uint16_t *)__read_stack_pointer();
+    uint16_t n = 0;
+
+    while(p + n < sp && p[n] == STACK_PAINT)
+        n++;
+    return n * 2;
+}
+
 /**
  * Interrupt service routine for the system ticks counter.
  * Note that the interrupt() macro is from legacymsp430.h.
  */
-interrupt(TIMER0_A0_VECTOR) TIMER0_A0_ISR(void)
+interrupt(TIMER1_A0_VECTOR) TIMER1_A0_ISR(void)
 {
     ticks++;
 }
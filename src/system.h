@@ -22,10 +22,19 @@
  */
 typedef uint32_t clock_time_t;
 
+/**
+ * The value that stack_paint() fills the unused stack with.
+ */
+#define STACK_PAINT 0xA5A5
+
 void clock_init(void);
 void sys_clock_init(void);
 clock_time_t clock_time(void);
+uint32_t clock_cycles(void);
+uint32_t clock_us(void);
 void _delay_ms(uint32_t delay);
+void stack_paint(void);
+uint16_t stack_unused(void);
 
 #endif /* __SYSTEM_H__ */
 
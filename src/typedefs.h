@@ -20,6 +20,7 @@
 
 typedef unsigned char uint8_t;
 typedef unsigned int uint16_t;
+typedef int int16_t;
 typedef long int32_t;
 typedef unsigned long uint32_t;
 
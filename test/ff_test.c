@@ -0,0 +1,605 @@
+/**
+ * A host side test of fatfs' FAT cache (see _FAT_CACHE in ffconf.h) and
+ * contiguous preallocation (f_expand()), run on a RAM disk holding a FAT16
+ * and then a FAT32 volume.
+ *
+ * For the cache, files are written, deleted and written again so that the
+ * allocations jump about the FAT and the cache has to keep evicting sectors,
+ * then the volume is synced and remounted and everything is read back.
+ *
+ * For preallocation, the run f_expand() links must be contiguous, writes
+ * inside it must not touch the FAT, and f_close() must give back the part
+ * that wasn't written. Throughout, the free cluster count fatfs keeps (which
+ * is counted when the volume is mounted without a valid FSInfo, see
+ * count_free()) must match the free entries actually in the FAT.
+ *
+ * The Makefile builds this once for each cache size, including none at all,
+ * and each build writes the FATs it leaves behind to <name>.fat. Every cache
+ * size must leave exactly the same FAT as the build without a cache.
+ *
+ * Build and run with "make" in this directory.
+ *
+ * @file ff_test.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ff.h"
+#include "diskio.h"
+
+/**
+ * The size of the RAM disk in sectors, enough for the FAT32 volume.
+ */
+#define DISK_SECTORS 72000UL
+
+/**
+ * The number of files written to begin with, every other one of which is
+ * then deleted to leave holes in the FAT.
+ */
+#define FIRST_FILES 8
+
+/**
+ * The length of each of the files written to begin with.
+ */
+#define FIRST_LEN 600000UL
+
+/**
+ * The number of files written at the same time into the holes, and their
+ * length.
+ */
+#define SECOND_FILES 2
+#define SECOND_LEN 1200000UL
+
+/**
+ * The amount added to the end of each of the files that are kept from the
+ * first lot.
+ */
+#define APPEND_LEN 100000UL
+
+/**
+ * The size of each write, which is deliberately not a whole number of
+ * sectors.
+ */
+#define CHUNK 1536
+
+/**
+ * The number of clusters preallocated, and the number of them written.
+ */
+#define EXPAND_CLUSTERS 300
+#define WRITE_CLUSTERS 120
+
+/**
+ * Report a failed check along with where it failed, and give up.
+ * @param c The condition that must hold
+ */
+#define check_m(c) do { if(!(c)) { printf("%s:%d: %s failed\n", \
+        __FILE__, __LINE__, #c); exit(1); } } while(0)
+
+/**
+ * The value of the byte at a given position in a given file.
+ * @param f The number of the file
+ * @param i The position of the byte in the file
+ */
+#define pattern_m(f, i) ((BYTE)((i) % 251 + (f) * 37))
+
+/// The RAM disk
+static BYTE *disk;
+
+/// The file system under test
+static FATFS fs;
+
+/// Files being written or read
+static FIL fil[SECOND_FILES];
+
+/// Data to be written or that has been read back
+static BYTE buf[CHUNK];
+
+/// The number of reads from the FAT area of the disk
+static DWORD fat_reads;
+
+/**
+ * Start the RAM disk. It is only allocated the first time, and keeps its
+ * contents across remounts.
+ * @param drv The drive number, which is always 0
+ * @returns The drive status
+ */
+DSTATUS disk_initialize(BYTE drv)
+{
+    (void)drv;
+    if(!disk)
+        disk = calloc(DISK_SECTORS, 512);
+    return disk ? 0 : STA_NOINIT;
+}
+
+/**
+ * Get the status of the RAM disk.
+ * @param drv The drive number, which is always 0
+ * @returns The drive status
+ */
+DSTATUS disk_status(BYTE drv)
+{
+    (void)drv;
+    return disk ? 0 : STA_NOINIT;
+}
+
+/**
+ * Read sectors from the RAM disk.
+ * @param drv The drive number, which is always 0
+ * @param buff Where to put the data
+ * @param sector The first sector to read
+ * @param count The number of sectors to read
+ * @returns RES_OK, or RES_PARERR if the sectors are off the end of the disk
+ */
+DRESULT disk_read(BYTE drv, BYTE *buff, DWORD sector, BYTE count)
+{
+    (void)drv;
+    if(sector + count > DISK_SECTORS)
+        return RES_PARERR;
+    if(fs.fs_type && sector >= fs.fatbase &&
+            sector < fs.fatbase + fs.n_fats * fs.fsize)
+        fat_reads++;
+    memcpy(buff, disk + sector * 512UL, count * 512UL);
+    return RES_OK;
+}
+
+/**
+ * Write sectors to the RAM disk.
+ * @param drv The drive number, which is always 0
+ * @param buff The data to write
+ * @param sector The first sector to write
+ * @param count The number of sectors to write
+ * @returns RES_OK, or RES_PARERR if the sectors are off the end of the disk
+ */
+DRESULT disk_write(BYTE drv, const BYTE *buff, DWORD sector, BYTE count)
+{
+    (void)drv;
+    if(sector + count > DISK_SECTORS)
+        return RES_PARERR;
+    memcpy(disk + sector * 512UL, buff, count * 512UL);
+    return RES_OK;
+}
+
+/**
+ * Handle the control codes that fatfs uses. The RAM disk has nothing to sync
+ * and erasing is only a hint, so neither does anything.
+ * @param drv The drive number, which is always 0
+ * @param ctrl The control code
+ * @param buff The code's data
+ * @returns RES_OK, or RES_PARERR for a code that isn't handled
+ */
+DRESULT disk_ioctl(BYTE drv, BYTE ctrl, void *buff)
+{
+    (void)drv;
+    (void)buff;
+    return ctrl == CTRL_SYNC || ctrl == CTRL_ERASE_SECTOR ? RES_OK : RES_PARERR;
+}
+
+/**
+ * Give fatfs the time to stamp files with, which is always the same so that
+ * every build leaves the same directory entries.
+ * @returns 1 January 2014, midnight
+ */
+DWORD get_fattime(void)
+{
+    return (DWORD)(2014 - 1980) << 25 | 1UL << 21 | 1UL << 16;
+}
+
+/**
+ * Store a little endian word in the RAM disk.
+ * @param p Where to store it
+ * @param v The value
+ */
+static void st_word(BYTE *p, WORD v)
+{
+    p[0] = (BYTE)v;
+    p[1] = (BYTE)(v >> 8);
+}
+
+/**
+ * Store a little endian double word in the RAM disk.
+ * @param p Where to store it
+ * @param v The value
+ */
+static void st_dword(BYTE *p, DWORD v)
+{
+    st_word(p, (WORD)v);
+    st_word(p + 2, (WORD)(v >> 16));
+}
+
+/**
+ * Load a little endian double word from the RAM disk.
+ * @param p Where to load it from
+ * @returns The value
+ */
+static DWORD ld_dword(const BYTE *p)
+{
+    return p[0] | (DWORD)p[1] << 8 | (DWORD)p[2] << 16 | (DWORD)p[3] << 24;
+}
+
+/**
+ * Load an entry from the first FAT on the disk. This only sees what fatfs
+ * has written back, so the volume must have been synced.
+ * @param clst The cluster
+ * @returns The cluster's entry, with the reserved bits of FAT32 cleared
+ */
+static DWORD fat_entry(DWORD clst)
+{
+    const BYTE *p = disk + fs.fatbase * 512UL;
+
+    if(fs.fs_type == FS_FAT32)
+        return ld_dword(p + clst * 4) & 0x0FFFFFFF;
+    return p[clst * 2] | p[clst * 2 + 1] << 8;
+}
+
+/**
+ * Check whether a FAT entry marks the end of a chain.
+ * @param v The entry
+ * @returns 1 if it does, 0 if not
+ */
+static uint8_t fat_eoc(DWORD v)
+{
+    return v >= (fs.fs_type == FS_FAT32 ? 0x0FFFFFF8UL : 0xFFF8UL);
+}
+
+/**
+ * Check that the free cluster count fatfs keeps matches the number of free
+ * entries in the FAT on the disk. The volume must have been synced.
+ */
+static void check_free(void)
+{
+    DWORD clst, n = 0;
+
+    for(clst = 2; clst < fs.n_fatent; clst++)
+        if(!fat_entry(clst))
+            n++;
+    check_m(fs.free_clust == n);
+}
+
+/**
+ * Get the number of times that fatfs has looked at the FAT, from its cache's
+ * counts or, without a cache, from the reads of FAT sectors.
+ * @returns The number of FAT accesses so far
+ */
+static DWORD fat_accesses(void)
+{
+#if _FAT_CACHE
+    return fs.fc_hit + fs.fc_miss + fat_reads;
+#else
+    return fat_reads;
+#endif
+}
+
+/**
+ * Format the RAM disk with an empty volume and no partition table. The
+ * FAT16 volume is 16MB in 2KB clusters, which gives 32 sectors of FAT. The
+ * FAT32 volume has 70000 single sector clusters, which is as small as FAT32
+ * can be and gives 547 sectors of FAT, and no FSInfo to start with.
+ * @param fat32 1 for FAT32, 0 for FAT16
+ */
+static void format(uint8_t fat32)
+{
+    DWORD sectors = fat32 ? 71126UL : 32768UL;
+    DWORD fatsz = fat32 ? 547 : 32;
+    WORD rsvd = fat32 ? 32 : 1;
+    BYTE *bs = disk;
+    BYTE *fat;
+    uint8_t i;
+
+    memset(disk, 0, DISK_SECTORS * 512UL);
+    st_word(bs + 11, 512);
+    bs[13] = fat32 ? 1 : 4;
+    st_word(bs + 14, rsvd);
+    bs[16] = 2;
+    bs[21] = 0xF8;
+    if(fat32)
+    {
+        st_dword(bs + 32, sectors);
+        st_dword(bs + 36, fatsz);
+        st_dword(bs + 44, 2);
+        st_word(bs + 48, 1);
+        memcpy(bs + 82, "FAT32   ", 8);
+    } else {
+        st_word(bs + 17, 512);
+        st_word(bs + 19, (WORD)sectors);
+        st_word(bs + 22, (WORD)fatsz);
+        memcpy(bs + 54, "FAT16   ", 8);
+    }
+    st_word(bs + 510, 0xAA55);
+
+    // The reserved entries, and on FAT32 the root directory's cluster
+    for(i = 0; i < 2; i++)
+    {
+        fat = disk + (rsvd + i * fatsz) * 512UL;
+        if(fat32)
+        {
+            st_dword(fat, 0x0FFFFFF8);
+            st_dword(fat + 4, 0x0FFFFFFF);
+            st_dword(fat + 8, 0x0FFFFFFF);
+        } else {
+            st_word(fat, 0xFFF8);
+            st_word(fat + 2, 0xFFFF);
+        }
+    }
+}
+
+/**
+ * Get the name of a test file.
+ * @param f The number of the file
+ * @returns The name, which is only valid until the next call
+ */
+static const char *name(uint8_t f)
+{
+    static char n[16];
+
+    sprintf(n, "f%u.bin", f);
+    return n;
+}
+
+/**
+ * Write data to an open file, continuing its pattern from where it ends.
+ * @param fp A pointer to the file
+ * @param f The number of the file
+ * @param len The number of bytes to write
+ */
+static void write_file(FIL *fp, uint8_t f, DWORD len)
+{
+    DWORD pos = f_size(fp);
+    UINT n, i, bw;
+
+    check_m(f_tell(fp) == pos);
+    while(len)
+    {
+        n = len < CHUNK ? len : CHUNK;
+        for(i = 0; i < n; i++)
+            buf[i] = pattern_m(f, pos + i);
+        check_m(f_write(fp, buf, n, &bw) == FR_OK);
+        check_m(bw == n);
+        pos += n;
+        len -= n;
+    }
+}
+
+/**
+ * Read a file back and check its length and contents.
+ * @param f The number of the file
+ * @param len The length the file must be
+ */
+static void check_file(uint8_t f, DWORD len)
+{
+    DWORD pos = 0;
+    UINT n, i, br;
+
+    check_m(f_open(&fil[0], name(f), FA_READ) == FR_OK);
+    check_m(f_size(&fil[0]) == len);
+    while(pos < len)
+    {
+        n = len - pos < CHUNK ? len - pos : CHUNK;
+        check_m(f_read(&fil[0], buf, n, &br) == FR_OK);
+        check_m(br == n);
+        for(i = 0; i < n; i++)
+            check_m(buf[i] == pattern_m(f, pos + i));
+        pos += n;
+    }
+    check_m(f_close(&fil[0]) == FR_OK);
+}
+
+/**
+ * Run the FAT cache test on one volume and write the FATs it leaves to a
+ * file.
+ * @param fat32 1 for FAT32, 0 for FAT16
+ * @param out The file to write the FATs to
+ */
+static void test_cache(uint8_t fat32, FILE *out)
+{
+    DWORD fre, fatsz;
+    FATFS *pfs;
+    FILINFO fno;
+    WORD rsvd;
+    uint8_t f, g;
+
+    format(fat32);
+    check_m(f_mount(0, &fs) == FR_OK);
+
+    // Fill the start of the volume one file at a time, then delete every
+    // other file to leave holes all over the FAT
+    for(f = 0; f < FIRST_FILES; f++)
+    {
+        check_m(f_open(&fil[0], name(f), FA_WRITE | FA_CREATE_ALWAYS) == FR_OK);
+        write_file(&fil[0], f, FIRST_LEN);
+        check_m(f_close(&fil[0]) == FR_OK);
+    }
+    check_m(fs.fs_type == (fat32 ? FS_FAT32 : FS_FAT16));
+    for(f = 1; f < FIRST_FILES; f += 2)
+        check_m(f_unlink(name(f)) == FR_OK);
+    check_free();
+
+    // Write files into the holes at the same time, so that each new cluster
+    // is linked onto a chain in a different part of the FAT to the last
+    for(g = 0; g < SECOND_FILES; g++)
+        check_m(f_open(&fil[g], name(FIRST_FILES + g),
+                    FA_WRITE | FA_CREATE_ALWAYS) == FR_OK);
+    for(fre = 0; fre < SECOND_LEN; fre += CHUNK)
+        for(g = 0; g < SECOND_FILES; g++)
+            write_file(&fil[g], FIRST_FILES + g, SECOND_LEN - fre < CHUNK ?
+                    SECOND_LEN - fre : CHUNK);
+    check_m(f_close(&fil[0]) == FR_OK);
+
+    // Add to the end of the files that are left, which follows their chains
+    // from the start of the FAT
+    for(f = 0; f < FIRST_FILES; f += 2)
+    {
+        check_m(f_open(&fil[0], name(f), FA_WRITE | FA_OPEN_EXISTING) == FR_OK);
+        check_m(f_lseek(&fil[0], f_size(&fil[0])) == FR_OK);
+        write_file(&fil[0], f, APPEND_LEN);
+        check_m(f_close(&fil[0]) == FR_OK);
+    }
+    check_free();
+#if _FAT_CACHE
+    // The cache must have been too small to hold everything
+    check_m(fs.fc_miss > _FAT_CACHE);
+#endif
+
+    // Sync the last file without closing it, which must still leave the
+    // whole FAT on the disk, and remount
+    check_m(f_sync(&fil[1]) == FR_OK);
+    check_m(f_getfree("", &fre, &pfs) == FR_OK);
+    check_m(f_mount(0, &fs) == FR_OK);
+
+    for(f = 0; f < FIRST_FILES; f++)
+    {
+        if(f & 1)
+            check_m(f_stat(name(f), &fno) == FR_NO_FILE);
+        else
+            check_file(f, FIRST_LEN + APPEND_LEN);
+    }
+    for(g = 0; g < SECOND_FILES; g++)
+        check_file(FIRST_FILES + g, SECOND_LEN);
+    check_m(fs.free_clust == fre);
+
+    // Both copies of the FAT must be the same, and they go to the file for
+    // the Makefile to compare with the other builds
+    rsvd = disk[14] | disk[15] << 8;
+    fatsz = fat32 ? ld_dword(disk + 36) : (DWORD)(disk[22] | disk[23] << 8);
+    check_m(!memcmp(disk + rsvd * 512UL, disk + (rsvd + fatsz) * 512UL,
+                fatsz * 512UL));
+    check_m(fwrite(disk + rsvd * 512UL, 512, fatsz, out) == fatsz);
+
+    check_m(f_mount(0, NULL) == FR_OK);
+}
+
+/**
+ * Mount the volume again and check the free cluster count it starts with.
+ */
+static void remount(void)
+{
+    FILINFO fno;
+
+    check_m(f_mount(0, &fs) == FR_OK);
+    check_m(f_stat("none", &fno) == FR_NO_FILE);
+    check_free();
+}
+
+/**
+ * Run the preallocation test on one volume.
+ * @param fat32 1 for FAT32, 0 for FAT16
+ */
+static void test_expand(uint8_t fat32)
+{
+    DWORD clust_len, fre, clst, acc;
+    FIL *fp = &fil[0];
+    uint8_t f;
+
+    format(fat32);
+    check_m(f_mount(0, &fs) == FR_OK);
+
+    // Neither volume has a valid free count on the disk, so it is counted
+    // as the volume is mounted
+    remount();
+    check_m(fs.free_clust == fs.n_fatent - (fat32 ? 3 : 2));
+    clust_len = fs.csize * 512UL;
+
+    // Put a small file first so that the run doesn't start at cluster 2
+    check_m(f_open(fp, name(0), FA_WRITE | FA_CREATE_ALWAYS) == FR_OK);
+    write_file(fp, 0, 3 * clust_len - 100);
+    check_m(f_close(fp) == FR_OK);
+    check_free();
+    fre = fs.free_clust;
+
+    // The run is linked as one contiguous chain and counted as used
+    check_m(f_open(fp, name(1), FA_WRITE | FA_CREATE_ALWAYS) == FR_OK);
+    check_m(f_expand(fp, EXPAND_CLUSTERS * clust_len - 100, 1) == FR_OK);
+    check_m(fp->sclust > 2 && fp->ecl == fp->sclust + EXPAND_CLUSTERS - 1);
+    check_m(f_expand(fp, clust_len, 0) == FR_DENIED);
+    check_m(f_sync(fp) == FR_OK);
+    for(clst = fp->sclust; clst < fp->ecl; clst++)
+        check_m(fat_entry(clst) == clst + 1);
+    check_m(fat_eoc(fat_entry(fp->ecl)));
+    check_m(fs.free_clust == fre - EXPAND_CLUSTERS);
+    check_free();
+
+    // Writing inside the run never looks at the FAT
+    acc = fat_accesses();
+    write_file(fp, 1, WRITE_CLUSTERS * clust_len - 100);
+    check_m(fat_accesses() == acc);
+    check_m(fp->clust == fp->sclust + WRITE_CLUSTERS - 1);
+
+    // Closing gives back the clusters after the last one written, which
+    // this fills exactly
+    write_file(fp, 1, 100);
+    clst = fp->sclust;
+    check_m(f_close(fp) == FR_OK);
+    check_m(fat_eoc(fat_entry(clst + WRITE_CLUSTERS - 1)));
+    for(acc = WRITE_CLUSTERS; acc < EXPAND_CLUSTERS; acc++)
+        check_m(!fat_entry(clst + acc));
+    check_m(fs.free_clust == fre - WRITE_CLUSTERS);
+    check_free();
+    check_file(1, WRITE_CLUSTERS * clust_len);
+
+    // A file that grows past its run carries on through the FAT
+    check_m(f_open(fp, name(2), FA_WRITE | FA_CREATE_ALWAYS) == FR_OK);
+    check_m(f_expand(fp, 4 * clust_len, 0) == FR_OK);
+    write_file(fp, 2, 6 * clust_len + 7);
+    check_m(f_close(fp) == FR_OK);
+    check_free();
+    check_file(2, 6 * clust_len + 7);
+
+    // A run that is never written is given back whole
+    fre = fs.free_clust;
+    check_m(f_open(fp, name(3), FA_WRITE | FA_CREATE_ALWAYS) == FR_OK);
+    check_m(f_expand(fp, EXPAND_CLUSTERS * clust_len, 0) == FR_OK);
+    check_m(f_close(fp) == FR_OK);
+    check_m(fs.free_clust == fre);
+    check_free();
+    check_file(3, 0);
+
+    // More than is free is refused without changing anything
+    check_m(f_open(fp, name(4), FA_WRITE | FA_CREATE_ALWAYS) == FR_OK);
+    check_m(f_expand(fp, (fre + 1) * clust_len, 0) == FR_DENIED);
+    check_m(fs.free_clust == fre);
+    check_m(f_close(fp) == FR_OK);
+    check_free();
+
+    // The count is right after a remount whether it comes from FSInfo or
+    // has to be counted again
+    remount();
+    if(fat32)
+    {
+        fre = fs.free_clust;
+        check_m(ld_dword(disk + 512) == 0x41615252);
+        disk[512] = 0;
+        remount();
+        check_m(fs.free_clust == fre);
+    }
+
+    // And deleting everything frees every cluster that was used
+    for(f = 0; f < 5; f++)
+        check_m(f_unlink(name(f)) == FR_OK);
+    remount();
+    check_m(fs.free_clust == fs.n_fatent - (fat32 ? 3 : 2));
+
+    check_m(f_mount(0, NULL) == FR_OK);
+}
+
+int main(int argc, char **argv)
+{
+    char path[256];
+    FILE *out;
+
+    (void)argc;
+    snprintf(path, sizeof(path), "%s.fat", argv[0]);
+    out = fopen(path, "wb");
+    check_m(out != NULL);
+    check_m(disk_initialize(0) == 0);
+
+    test_cache(0, out);
+    test_cache(1, out);
+    test_expand(0);
+    test_expand(1);
+
+    check_m(fclose(out) == 0);
+    printf("ff: _FAT_CACHE %u, FAT16 and FAT32, OK\n", _FAT_CACHE);
+    return 0;
+}
@@ -0,0 +1,34 @@
+/**
+ * Stands in for src/integer.h in the host build of fatfs. The FatFs types
+ * there are defined in terms of int and long, which are wider on the host
+ * than fatfs expects, so these come from <stdint.h> instead. The Makefile
+ * includes this ahead of everything else for the fatfs tests and the shared
+ * include guard stops src/integer.h from being read afterwards.
+ *
+ * @file integer.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ */
+
+#ifndef _INTEGER
+#define _INTEGER
+
+#include <stdint.h>
+
+typedef int             INT;
+typedef unsigned int    UINT;
+
+typedef char            CHAR;
+typedef unsigned char   UCHAR;
+typedef unsigned char   BYTE;
+
+typedef int16_t         SHORT;
+typedef uint16_t        USHORT;
+typedef uint16_t        WORD;
+typedef uint16_t        WCHAR;
+
+typedef int32_t         LONG;
+typedef uint32_t        ULONG;
+typedef uint32_t        DWORD;
+
+#endif /* _INTEGER */
@@ -0,0 +1,8 @@
+/**
+ * An empty stand in for the MSP430 device header, so that the modules that
+ * don't touch the hardware can be built and tested on the host.
+ *
+ * @file msp430.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ */
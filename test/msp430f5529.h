@@ -0,0 +1,9 @@
+/**
+ * An empty stand in for the MSP430 toolchain header of the same name, so
+ * that the modules that don't touch the hardware can be built and tested on
+ * the host.
+ *
+ * @file msp430f5529.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ */
@@ -0,0 +1,207 @@
+/**
+ * A host side round trip test for the Rice coder. Sectors of 14 bit channels
+ * stepping full scale are coded with rice.c and decoded again here, following
+ * the decoder in parser/parse.py, and every value must come back unchanged.
+ * Steps that big drive the running averages up to RICE_ACC_MAX, so this
+ * checks that the coder and the decoder hold them there in the same way.
+ *
+ * Build and run with "make" in this directory.
+ *
+ * @file rice_test.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "rice.h"
+
+/**
+ * The number of sets of samples coded, which fill a few hundred sectors.
+ */
+#define TEST_SETS 100000UL
+
+/**
+ * The width in bits of every channel, as for an oversampled ADC channel.
+ */
+#define TEST_WIDTH 14
+
+/**
+ * Report a failed check along with where it failed, and give up.
+ * @param c The condition that must hold
+ */
+#define check_m(c) do { if(!(c)) { printf("%s:%d: %s failed\n", \
+        __FILE__, __LINE__, #c); exit(1); } } while(0)
+
+/// The decoder's state, which is kept across the sets in a sector
+typedef struct Decoder
+{
+    const char *buf;
+    uint16_t bit;
+    uint8_t have[RICE_CHANNELS];
+    uint16_t prev[RICE_CHANNELS];
+    uint32_t acc[RICE_CHANNELS];
+} Decoder;
+
+/// A small linear congruential generator, so every run is the same
+static uint32_t seed = 1;
+
+/**
+ * Get a pseudo random number.
+ * @param n The number of possible values
+ * @returns A number from 0 to n - 1
+ */
+static uint16_t rnd(uint16_t n)
+{
+    seed = seed * 1103515245UL + 12345;
+    return (uint16_t)((seed >> 16) % n);
+}
+
+/**
+ * Read n bits from the sector, most significant first.
+ * @param d A pointer to the decoder
+ * @param n The number of bits to read
+ * @returns The bits read
+ */
+static uint16_t get_bits(Decoder *d, uint8_t n)
+{
+    uint16_t v = 0;
+
+    while(n--)
+    {
+        check_m(d->bit < SD_SECTOR_LEN * 8);
+        v = (v << 1) | ((d->buf[d->bit >> 3] >> (7 - (d->bit & 7))) & 1);
+        d->bit++;
+    }
+    return v;
+}
+
+/**
+ * Choose the Rice parameter from a running average, as parse.py does.
+ * @param acc The running average
+ * @returns The Rice parameter k
+ */
+static uint8_t dec_k(uint32_t acc)
+{
+    uint8_t k = 0;
+
+    while(k < 12 && (4UL << k) <= acc)
+        k++;
+    return k;
+}
+
+/**
+ * Decode one set of samples holding every channel, as parse.py does, with
+ * the running averages kept wide enough that they could never wrap.
+ * @param d A pointer to the decoder
+ * @param v Where to put the decoded channel values
+ */
+static void decode_set(Decoder *d, uint16_t *v)
+{
+    uint16_t q, z;
+    uint8_t i, k;
+
+    check_m(get_bits(d, 1) == 0);
+    for(i = 0; i < RICE_CHANNELS; i++)
+    {
+        if(!d->have[i])
+        {
+            v[i] = get_bits(d, TEST_WIDTH);
+            d->have[i] = 1;
+            d->prev[i] = v[i];
+            continue;
+        }
+        k = dec_k(d->acc[i]);
+        for(q = 0; q < RICE_ESC && get_bits(d, 1); q++);
+        if(q == RICE_ESC)
+        {
+            v[i] = get_bits(d, TEST_WIDTH);
+            z = v[i] >= d->prev[i] ? 2 * (v[i] - d->prev[i]) :
+                2 * (d->prev[i] - v[i]) - 1;
+        } else {
+            z = (q << k) | get_bits(d, k);
+            v[i] = z & 1 ? d->prev[i] - (z + 1) / 2 : d->prev[i] + z / 2;
+        }
+        d->acc[i] = d->acc[i] - (d->acc[i] >> 2) + z;
+        if(d->acc[i] > RICE_ACC_MAX)
+            d->acc[i] = RICE_ACC_MAX;
+        d->prev[i] = v[i];
+    }
+}
+
+/**
+ * Get the next value of a channel. Channel 0 steps between the ends of the
+ * range, channel 1 jumps about at random and the rest step full scale for a
+ * while and then settle, so that their averages have to come back down.
+ * @param i The channel
+ * @param n The number of the set
+ * @param last The channel's previous value
+ * @returns The value
+ */
+static uint16_t next_value(uint8_t i, uint32_t n, uint16_t last)
+{
+    const uint16_t top = (1U << TEST_WIDTH) - 1;
+
+    if(i == 0)
+        return n & 1 ? top : 0;
+    if(i == 1)
+        return rnd(top + 1);
+    if((n / (100 * i)) & 1)
+        return last == top ? 0 : top;
+    return last < 2 ? rnd(4) : last + rnd(3) - 1;
+}
+
+int main(void)
+{
+    static uint8_t width[RICE_CHANNELS];
+    static char sector[SD_SECTOR_LEN];
+    static uint16_t sets[SD_SECTOR_LEN * 8][RICE_CHANNELS];
+    RiceEncoder e;
+    Decoder d;
+    uint16_t v[RICE_CHANNELS], last[RICE_CHANNELS] = {0};
+    uint16_t j;
+    uint32_t n = 0, sectors = 0, held = 0;
+    uint8_t i;
+
+    for(i = 0; i < RICE_CHANNELS; i++)
+        width[i] = TEST_WIDTH;
+    while(n < TEST_SETS)
+    {
+        rice_start(&e, sector, 0, width);
+        for(j = 0; n < TEST_SETS; n++, j++)
+        {
+            for(i = 0; i < RICE_CHANNELS; i++)
+                sets[j][i] = next_value(i, n, last[i]);
+            if(!rice_sample(&e, sets[j], (1U << RICE_CHANNELS) - 1))
+                break;
+            for(i = 0; i < RICE_CHANNELS; i++)
+                last[i] = sets[j][i];
+        }
+        check_m(e.count == j);
+
+        d = (Decoder){ .buf = sector };
+        for(i = 0; i < RICE_CHANNELS; i++)
+            d.acc[i] = RICE_ACC_INIT;
+        for(j = 0; j < e.count; j++)
+        {
+            decode_set(&d, v);
+            for(i = 0; i < RICE_CHANNELS; i++)
+                check_m(v[i] == sets[j][i]);
+        }
+        for(i = 0; i < RICE_CHANNELS; i++)
+        {
+            check_m(d.acc[i] == e.acc[i]);
+            if(e.acc[i] == RICE_ACC_MAX)
+                held++;
+        }
+        sectors++;
+    }
+
+    // The averages must actually have been held at the top
+    check_m(held > 0);
+
+    printf("rice: %lu sets in %lu sectors, %lu averages held at the top, "
+            "OK\n", (unsigned long)TEST_SETS, (unsigned long)sectors,
+            (unsigned long)held);
+    return 0;
+}
@@ -0,0 +1,365 @@
+/**
+ * A host side stress test for the ring buffer. The producer and consumer are
+ * first run in turn from a single thread and everything they do is checked
+ * against a simple model: the data that comes out, the head and tail indices,
+ * the amount in use and when a reservation should fail. They are then run at
+ * the same time from two threads, as the ADC interrupt and the main loop use
+ * it, and the consumer checks that the stream comes out in order.
+ *
+ * Build and run with "make" in this directory.
+ *
+ * @file ringbuf_test.c
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "ringbuf.h"
+
+/**
+ * The number of random producer and consumer steps in the stress test. This
+ * takes both indices round the full 2 * RB_LEN range many times.
+ */
+#define STRESS_STEPS 2000000UL
+
+/**
+ * The number of bytes passed from the producer thread to the consumer thread,
+ * which takes the indices round the buffer thousands of times.
+ */
+#define THREAD_BYTES 100000000UL
+
+/**
+ * Report a failed check along with where it failed, and give up.
+ * @param c The condition that must hold
+ */
+#define check_m(c) do { if(!(c)) { printf("%s:%d: %s failed\n", \
+        __FILE__, __LINE__, #c); exit(1); } } while(0)
+
+/**
+ * The value of the byte at a given position in the stream. The period is
+ * prime so that it never lines up with the buffer, and a byte left over from
+ * a previous lap can't pass for the right one.
+ * @param i The position of the byte in the stream
+ */
+#define pattern_m(i) ((uint8_t)((i) % 251))
+
+/// The buffer under test
+static RingBuffer rb;
+
+/// The position in the stream of the next byte the producer writes
+static uint32_t put_pos;
+
+/// The position in the stream of the next byte the consumer expects
+static uint32_t get_pos;
+
+/// Where the model expects the head and tail indices to be
+static uint32_t model_head, model_tail;
+
+/// A small linear congruential generator, so every run is the same
+static uint32_t seed = 1;
+
+/**
+ * Get a pseudo random number from a given generator.
+ * @param s The state of the generator
+ * @param n The number of possible values
+ * @returns A number from 0 to n - 1
+ */
+static uint16_t rnd_from(uint32_t *s, uint16_t n)
+{
+    *s = *s * 1103515245UL + 12345;
+    return (uint16_t)((*s >> 16) % n);
+}
+
+/**
+ * Get a pseudo random number from the single threaded tests' generator.
+ * @param n The number of possible values
+ * @returns A number from 0 to n - 1
+ */
+static uint16_t rnd(uint16_t n)
+{
+    return rnd_from(&seed, n);
+}
+
+/**
+ * Check the buffer indices and use count against the model.
+ */
+static void check_state(void)
+{
+    check_m(rb.head == model_head % (2 * RB_LEN));
+    check_m(rb.tail == model_tail % (2 * RB_LEN));
+    check_m(rb_getused(&rb) == model_head - model_tail);
+}
+
+/**
+ * Try to write a record of n bytes. The reservation must succeed exactly when
+ * the model has room for it.
+ * @param n The length of the record
+ * @param commit The number of bytes of the reservation to commit
+ * @returns 1 if the record was written, 0 if the buffer was full
+ */
+static uint8_t produce(uint16_t n, uint16_t commit)
+{
+    uint16_t free = RB_LEN - (uint16_t)(model_head - model_tail);
+    uint16_t i;
+    char *p;
+
+    rb.overflow = 0;
+    p = rb_reserve(&rb, n);
+    if(n > free)
+    {
+        check_m(p == NULL);
+        check_m(rb.overflow);
+        check_state();
+        return 0;
+    }
+    check_m(p != NULL);
+    check_m(!rb.overflow);
+
+    // The reservation must start at the head and may only run into the slack
+    check_m(p == rb.buf + model_head % RB_LEN);
+    check_m(p + n <= rb.buf + RB_LEN + RB_RESERVE_MAX);
+
+    for(i = 0; i < commit; i++)
+        p[i] = pattern_m(put_pos++);
+    // Scribble over the rest, which must never be seen by the consumer
+    for(; i < n; i++)
+        p[i] = (char)0xA5;
+
+    // Nothing is visible until the commit
+    check_state();
+    rb_commit(&rb, commit);
+    model_head += commit;
+    check_state();
+    return 1;
+}
+
+/**
+ * Take at most n bytes from the buffer and check them against the model.
+ * @param n The most bytes to release
+ * @returns The number of bytes released
+ */
+static uint16_t consume(uint16_t n)
+{
+    uint16_t avail, i;
+    uint16_t used = (uint16_t)(model_head - model_tail);
+    uint16_t off = model_tail % RB_LEN;
+    char *p;
+
+    p = rb_peek(&rb, &avail);
+    check_m(p == rb.buf + off);
+    // The span is everything committed, cut short at the end of the buffer
+    check_m(avail == (used < RB_LEN - off ? used : RB_LEN - off));
+
+    if(n > avail)
+        n = avail;
+    for(i = 0; i < n; i++)
+        check_m((uint8_t)p[i] == pattern_m(get_pos++));
+
+    rb_release(&rb, n);
+    model_tail += n;
+    check_state();
+    return n;
+}
+
+/**
+ * An empty buffer has nothing to peek at, and reservations that are too big
+ * fail without flagging an overflow.
+ */
+static void test_empty(void)
+{
+    uint16_t n;
+
+    rb_reset(&rb);
+    check_state();
+    rb_peek(&rb, &n);
+    check_m(n == 0);
+    check_m(rb_reserve(&rb, RB_RESERVE_MAX + 1) == NULL);
+    check_m(!rb.overflow);
+    check_m(rb_reserve(&rb, 0) == rb.buf);
+}
+
+/**
+ * Fill the buffer, check that it refuses any more and then empty it again,
+ * twice over so that the indices pass RB_LEN and come back round to 0.
+ */
+static void test_full(void)
+{
+    uint8_t pass;
+
+    for(pass = 0; pass < 2; pass++)
+    {
+        while(produce(RB_RESERVE_MAX, RB_RESERVE_MAX));
+        check_m(rb_getused(&rb) == RB_LEN);
+        check_m(!produce(1, 1));
+
+        // A full buffer is seen in one span and releasing it empties it
+        check_m(consume(RB_LEN) == RB_LEN);
+        check_m(rb_getused(&rb) == 0);
+        check_m(consume(RB_LEN) == 0);
+    }
+    check_m(rb.head == 0);
+}
+
+/**
+ * Write records that run into the slack at every possible split, and check
+ * that they are moved round to the start and read back in two spans.
+ */
+static void test_wrap(void)
+{
+    uint16_t split, n;
+
+    for(split = 1; split < RB_RESERVE_MAX; split++)
+    {
+        // Move the head to just short of the end of the buffer
+        while(RB_LEN - model_head % RB_LEN > split)
+        {
+            n = RB_LEN - model_head % RB_LEN - split;
+            produce(n < RB_RESERVE_MAX ? n : RB_RESERVE_MAX,
+                    n < RB_RESERVE_MAX ? n : RB_RESERVE_MAX);
+            consume(RB_LEN);
+        }
+
+        // A whole record must fit, even though only split bytes of it are
+        // before the end of the buffer
+        check_m(produce(RB_RESERVE_MAX, RB_RESERVE_MAX));
+        check_m(rb_getused(&rb) == RB_RESERVE_MAX);
+        check_m(consume(RB_LEN) == split);
+        check_m(consume(RB_LEN) == RB_RESERVE_MAX - split);
+        check_m(rb_getused(&rb) == 0);
+    }
+
+    // Fill the buffer from just short of the end, so that the first record
+    // wraps and the full buffer is then read back in two spans
+    while(model_head % RB_LEN != RB_LEN - 8)
+    {
+        produce(1, 1);
+        consume(1);
+    }
+    while(produce(RB_RESERVE_MAX, RB_RESERVE_MAX));
+    check_m(RB_LEN - rb_getused(&rb) < RB_RESERVE_MAX);
+    check_m(consume(RB_LEN) == 8);
+    consume(RB_LEN);
+    check_m(rb_getused(&rb) == 0);
+}
+
+/**
+ * Run the producer and consumer in a random order with random sizes, and
+ * commit less than was reserved some of the time.
+ */
+static void test_stress(void)
+{
+    unsigned long step;
+    uint16_t n;
+
+    for(step = 0; step < STRESS_STEPS; step++)
+    {
+        if(rnd(2))
+        {
+            n = rnd(RB_RESERVE_MAX) + 1;
+            produce(n, rnd(4) ? n : rnd(n + 1));
+        }
+        else
+        {
+            // Mostly take whole sectors as the logger does
+            consume(rnd(4) ? 512 : rnd(RB_LEN + 1));
+        }
+    }
+    while(consume(RB_LEN));
+}
+
+/**
+ * The producer thread. Writes THREAD_BYTES of the stream in records of random
+ * length, sometimes committing less than it reserved, and waits for space
+ * whenever the buffer is full.
+ * @param arg Unused
+ * @returns NULL
+ */
+static void *producer(void *arg)
+{
+    uint32_t s = 2;
+    uint32_t pos = 0;
+    uint16_t n, commit, i;
+    char *p;
+
+    (void)arg;
+    while(pos < THREAD_BYTES)
+    {
+        n = rnd_from(&s, RB_RESERVE_MAX) + 1;
+        commit = rnd_from(&s, 4) ? n : rnd_from(&s, n + 1);
+        while((p = rb_reserve(&rb, n)) == NULL)
+            sched_yield();
+        check_m(rb_getused(&rb) <= RB_LEN - n);
+        for(i = 0; i < commit; i++)
+            p[i] = pattern_m(pos++);
+        for(; i < n; i++)
+            p[i] = (char)0xA5;
+        rb_commit(&rb, commit);
+    }
+    return NULL;
+}
+
+/**
+ * The consumer thread. Takes spans of random length and checks every byte
+ * against the stream until THREAD_BYTES have come through.
+ * @param arg Unused
+ * @returns NULL
+ */
+static void *consumer(void *arg)
+{
+    uint32_t s = 3;
+    uint32_t pos = 0;
+    uint16_t avail, n, i;
+    char *p;
+
+    (void)arg;
+    while(pos < THREAD_BYTES)
+    {
+        p = rb_peek(&rb, &avail);
+        check_m(avail <= RB_LEN);
+        if(!avail)
+        {
+            sched_yield();
+            continue;
+        }
+        n = rnd_from(&s, 4) ? avail : rnd_from(&s, avail) + 1;
+        for(i = 0; i < n; i++)
+            check_m((uint8_t)p[i] == pattern_m(pos++));
+        rb_release(&rb, n);
+    }
+    return NULL;
+}
+
+/**
+ * Run the producer and consumer at the same time on two threads.
+ */
+static void test_threads(void)
+{
+    pthread_t prod, cons;
+
+    rb_reset(&rb);
+    check_m(pthread_create(&cons, NULL, consumer, NULL) == 0);
+    check_m(pthread_create(&prod, NULL, producer, NULL) == 0);
+    check_m(pthread_join(prod, NULL) == 0);
+    check_m(pthread_join(cons, NULL) == 0);
+}
+
+int main(void)
+{
+    // The buffer must see the same index width as it does on the MSP430
+    check_m(sizeof(rb.head) == 2);
+
+    test_empty();
+    test_full();
+    test_wrap();
+    test_stress();
+    test_threads();
+
+    printf("ringbuf: RB_LEN %u, %lu random steps, %lu bytes across "
+            "threads, OK\n", RB_LEN, (unsigned long)STRESS_STEPS,
+            (unsigned long)THREAD_BYTES);
+    return 0;
+}
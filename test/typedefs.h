@@ -0,0 +1,25 @@
+/**
+ * Stands in for src/typedefs.h in the host build, where unsigned int is 32
+ * bits wide. The fixed width types come from <stdint.h> instead so that the
+ * modules under test see the same sizes as they do on the MSP430. The Makefile
+ * includes this ahead of everything else and the shared include guard stops
+ * src/typedefs.h from being read afterwards.
+ *
+ * @file typedefs.h
+ * @author Jon Sowman, University of Southampton <j.sowman@soton.ac.uk>
+ * @copyright Jon Sowman 2014, All Rights Reserved
+ */
+
+#ifndef __TYPEDEFS_H__
+#define __TYPEDEFS_H__
+
+#include <stdint.h>
+#include <msp430.h>
+
+/**
+ * This is shorthand from avr-libc
+ * @param x Shift 1 left by x bits
+ */
+#define _BV(x) (1<<x)
+
+#endif /* __TYPEDEFS_H__ */